@@ -15,6 +15,7 @@
 #include <linux/mm.h>
 #include <linux/slab.h>
 #include <linux/init.h>
+#include <linux/list.h>
 #include <asm/uaccess.h>
 #include <linux/consolemap.h>
 #include <linux/vt_kern.h>
@@ -169,16 +170,71 @@ static unsigned short translations[][256] = {
 
 static int inv_translate[MAX_NR_CONSOLES];
 
+/*
+ * Flat lookup table built from a complete uni_pagedir, used by
+ * conv_uni_to_pc().  Each plane has an index of its 256 pages of 256
+ * code points into a pool of dense glyph pages; pool page 0 has no
+ * glyphs.  Planes without mappings have no index at all.  The unipair
+ * interface only carries 16-bit values, so for now only plane 0 can
+ * have one and everything above U+FFFF gets the replacement glyph.
+ */
+struct uni_glyphs {
+	u16		*plane[17];
+	u16		*pages;
+	u16		replacement;	/* glyph of U+FFFD or 0xffff */
+};
+
 struct uni_pagedir {
 	u16 		**uni_pgdir[32];
+	struct uni_glyphs *glyphs;	/* NULL while being built */
 	unsigned long	refcount;
-	unsigned long	sum;
+	u32		hash;		/* of the contents, see unipair_hash() */
+	struct hlist_node hnode;	/* in unimap_hash once complete */
 	unsigned char	*inverse_translations[4];
 	int		readonly;
 };
 
 static struct uni_pagedir *dflt;
 
+/*
+ * Complete unimaps are kept in a hash table keyed by their contents, so
+ * that a newly loaded map finds an identical one to share without
+ * comparing it against every console.  A unimap is taken out of the
+ * table before it is changed in place.
+ */
+#define UNIMAP_HASH_BITS	6
+#define UNIMAP_HASH_SIZE	(1 << UNIMAP_HASH_BITS)
+
+static struct hlist_head unimap_hash[UNIMAP_HASH_SIZE];
+
+/*
+ * The hash of a unimap is the sum of the hashes of its (unicode, fontpos)
+ * pairs, so it does not depend on the load order and can be kept up to
+ * date as pairs are added or replaced.
+ */
+static inline u32 unipair_hash(u16 unicode, u16 fontpos)
+{
+	u32 x = ((u32)unicode << 16) | fontpos;
+
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	x ^= x >> 16;
+	return x;
+}
+
+static inline struct hlist_head *unimap_bucket(u32 hash)
+{
+	return &unimap_hash[hash & (UNIMAP_HASH_SIZE - 1)];
+}
+
+static inline void unimap_unhash(struct uni_pagedir *p)
+{
+	if (!hlist_unhashed(&p->hnode))
+		hlist_del_init(&p->hnode);
+}
+
 static void set_inverse_transl(struct vc_data *vc, struct uni_pagedir *p, int i)
 {
 	int j, glyph;
@@ -229,6 +285,19 @@ unsigned char inverse_translate(struct vc_data *vc, int glyph)
 		return p->inverse_translations[inv_translate[vc->vc_num]][glyph];
 }
 
+/*
+ * The table inverse_translate() uses for vc, or NULL if glyphs map to
+ * themselves.  For callers converting a whole row at a time.
+ */
+const unsigned char *inverse_translate_map(struct vc_data *vc)
+{
+	struct uni_pagedir *p = (struct uni_pagedir *)*vc->vc_uni_pagedir_loc;
+
+	if (!p)
+		return NULL;
+	return p->inverse_translations[inv_translate[vc->vc_num]];
+}
+
 static void update_user_maps(struct vc_data *vc)
 {
 	struct uni_pagedir *p, *q = NULL;
@@ -329,17 +398,92 @@ int con_get_trans_new(struct vc_data *vc, ushort __user *arg)
  * A hashtable is somewhat of a pain to deal with, so use a
  * "paged table" instead.  Simulation has shown the memory cost of
  * this 3-level paged table scheme to be comparable to a hash table.
+ * Once a unimap is complete, lookups go through the flat copy in
+ * struct uni_glyphs instead.
  */
 
 extern u8 dfont_unicount[];	/* Defined in console_defmap.c */
 extern u16 dfont_unitable[];
 
+static void con_free_glyphs(struct uni_pagedir *p)
+{
+	struct uni_glyphs *g = p->glyphs;
+	int i;
+
+	if (!g)
+		return;
+	p->glyphs = NULL;
+	for (i = 0; i < 17; i++)
+		if (g->plane[i])
+			kfree(g->plane[i]);
+	if (g->pages)
+		kfree(g->pages);
+	kfree(g);
+}
+
+/*
+ * Build the flat table of a complete unimap.  Failing is harmless,
+ * conv_uni_to_pc() then walks the paged table instead.
+ */
+static int con_build_glyphs(struct uni_pagedir *p)
+{
+	struct uni_glyphs *g;
+	u16 **p1, *idx;
+	int i, j, n = 1;
+
+	con_free_glyphs(p);
+	g = kmalloc(sizeof(*g), GFP_KERNEL);
+	if (!g)
+		return -ENOMEM;
+	memset(g, 0, sizeof(*g));
+	idx = g->plane[0] = kmalloc(256 * sizeof(u16), GFP_KERNEL);
+	if (!idx)
+		goto nomem;
+
+	/* a 256 code point page covers 4 pages of the paged table */
+	for (i = 0; i < 256; i++) {
+		idx[i] = 0;
+		if (!(p1 = p->uni_pgdir[i >> 3]))
+			continue;
+		for (j = 0; j < 4; j++)
+			if (p1[((i & 7) << 2) + j])
+				break;
+		if (j < 4)
+			idx[i] = n++;
+	}
+
+	g->pages = kmalloc(n * 256 * sizeof(u16), GFP_KERNEL);
+	if (!g->pages)
+		goto nomem;
+	memset(g->pages, 0xff, n * 256 * sizeof(u16));
+	for (i = 0; i < 256; i++) {
+		if (!idx[i])
+			continue;
+		p1 = p->uni_pgdir[i >> 3];
+		for (j = 0; j < 4; j++)
+			if (p1[((i & 7) << 2) + j])
+				memcpy(g->pages + (idx[i] << 8) + (j << 6),
+				       p1[((i & 7) << 2) + j], 64 * sizeof(u16));
+	}
+	g->replacement = g->pages[(idx[0xff] << 8) | 0xfd];
+	p->glyphs = g;
+	return 0;
+
+nomem:
+	p->glyphs = g;
+	con_free_glyphs(p);
+	return -ENOMEM;
+}
+
 static void con_release_unimap(struct uni_pagedir *p)
 {
 	u16 **p1;
 	int i, j;
 
 	if (p == dflt) dflt = NULL;  
+	unimap_unhash(p);
+	con_free_glyphs(p);
+	p->hash = 0;
 	for (i = 0; i < 32; i++) {
 		if ((p1 = p->uni_pgdir[i]) != NULL) {
 			for (j = 0; j < 32; j++)
@@ -368,71 +512,148 @@ void con_free_unimap(struct vc_data *vc)
 	kfree(p);
 }
   
-static int con_unify_unimap(struct vc_data *vc, struct uni_pagedir *p)
+static int unimap_equal(struct uni_pagedir *p, struct uni_pagedir *q)
 {
-	struct uni_pagedir *q;
-	int i, j, k;
-	
-	for (i = 0; i < vc->display_fg->vc_count; i++) {
-		struct vc_data *tmp = vc->display_fg->vc_cons[i]; 
+	int j, k;
 
-		if (!tmp)
-			continue;
-		q = (struct uni_pagedir *)*tmp->vc_uni_pagedir_loc;
-		if (!q || q == p || q->sum != p->sum)
+	for (j = 0; j < 32; j++) {
+		u16 **p1 = p->uni_pgdir[j], **q1 = q->uni_pgdir[j];
+
+		if (!p1 && !q1)
 			continue;
-		for (j = 0; j < 32; j++) {
-			u16 **p1, **q1;
-			p1 = p->uni_pgdir[j]; q1 = q->uni_pgdir[j];
-			if (!p1 && !q1)
+		if (!p1 || !q1)
+			return 0;
+		for (k = 0; k < 32; k++) {
+			if (!p1[k] && !q1[k])
 				continue;
-			if (!p1 || !q1)
-				break;
-			for (k = 0; k < 32; k++) {
-				if (!p1[k] && !q1[k])
-					continue;
-				if (!p1[k] || !q1[k])
-					break;
-				if (memcmp(p1[k], q1[k], 64*sizeof(u16)))
-					break;
-			}
-			if (k < 32)
-				break;
-		}
-		if (j == 32) {
-			q->refcount++;
-			*vc->vc_uni_pagedir_loc = (unsigned long)q;
-			con_release_unimap(p);
-			kfree(p);
-			return 1;
+			if (!p1[k] || !q1[k])
+				return 0;
+			if (memcmp(p1[k], q1[k], 64*sizeof(u16)))
+				return 0;
 		}
 	}
+	return 1;
+}
+
+/*
+ * p has just been built for vc.  Share an identical unimap instead if
+ * there is one, otherwise make p available for sharing.
+ */
+static int con_unify_unimap(struct vc_data *vc, struct uni_pagedir *p)
+{
+	struct hlist_head *head = unimap_bucket(p->hash);
+	struct hlist_node *node;
+	struct uni_pagedir *q;
+
+	hlist_for_each_entry(q, node, head, hnode) {
+		if (q == p || q->hash != p->hash || !unimap_equal(p, q))
+			continue;
+		q->refcount++;
+		*vc->vc_uni_pagedir_loc = (unsigned long)q;
+		con_release_unimap(p);
+		kfree(p);
+		return 1;
+	}
+	unimap_unhash(p);
+	hlist_add_head(&p->hnode, head);
 	return 0;
 }
 
-static int
-con_insert_unipair(struct uni_pagedir *p, u_short unicode, u_short fontpos)
+static u16 *con_unipair_page(struct uni_pagedir *p, u_short unicode)
 {
 	int i, n;
 	u16 **p1, *p2;
 
 	if (!(p1 = p->uni_pgdir[n = unicode >> 11])) {
 		p1 = p->uni_pgdir[n] = kmalloc(32*sizeof(u16 *), GFP_KERNEL);
-		if (!p1) return -ENOMEM;
+		if (!p1) return NULL;
 		for (i = 0; i < 32; i++)
 			p1[i] = NULL;
 	}
 
 	if (!(p2 = p1[n = (unicode >> 6) & 0x1f])) {
 		p2 = p1[n] = kmalloc(64*sizeof(u16), GFP_KERNEL);
-		if (!p2) return -ENOMEM;
+		if (!p2) return NULL;
 		memset(p2, 0xff, 64*sizeof(u16)); /* No glyphs for the characters (yet) */
 	}
+	return p2;
+}
 
-	p2[unicode & 0x3f] = fontpos;
-	
-	p->sum += (fontpos << 20) + unicode;
+static inline void
+con_set_unipair(struct uni_pagedir *p, u16 *p2, u_short unicode, u_short fontpos)
+{
+	u16 *e = &p2[unicode & 0x3f];
+
+	if (*e != 0xffff)
+		p->hash -= unipair_hash(unicode, *e);
+	*e = fontpos;
+	if (fontpos != 0xffff)
+		p->hash += unipair_hash(unicode, fontpos);
+}
 
+static int
+con_insert_unipair(struct uni_pagedir *p, u_short unicode, u_short fontpos)
+{
+	u16 *p2 = con_unipair_page(p, unicode);
+
+	if (!p2) return -ENOMEM;
+	con_set_unipair(p, p2, unicode, fontpos);
+	return 0;
+}
+
+#define UNIPAIR_BATCH	(PAGE_SIZE / sizeof(struct unipair))
+
+/*
+ * Bulk version of con_insert_unipair().  The page of the previous pair
+ * is reused, so a list sorted by unicode looks up or allocates every
+ * 64-entry page only once.  Later pairs override earlier ones, as with
+ * the single inserts.
+ */
+static int
+con_insert_unipairs(struct uni_pagedir *p, const struct unipair *list, int ct)
+{
+	u16 *p2 = NULL;
+	int page = -1, err = 0;
+
+	for (; ct > 0; ct--, list++) {
+		if ((list->unicode >> 6) != page) {
+			p2 = con_unipair_page(p, list->unicode);
+			if (!p2) {
+				err = -ENOMEM;
+				page = -1;
+				continue;
+			}
+			page = list->unicode >> 6;
+		}
+		con_set_unipair(p, p2, list->unicode, list->fontpos);
+	}
+	return err;
+}
+
+/* Copy the pages of p into the empty unimap q */
+static int con_copy_unipages(struct uni_pagedir *q, struct uni_pagedir *p)
+{
+	u16 **p1, **q1;
+	int i, j;
+
+	for (i = 0; i < 32; i++) {
+		if (!(p1 = p->uni_pgdir[i]))
+			continue;
+		q1 = q->uni_pgdir[i] = kmalloc(32*sizeof(u16 *), GFP_KERNEL);
+		if (!q1)
+			return -ENOMEM;
+		for (j = 0; j < 32; j++)
+			q1[j] = NULL;
+		for (j = 0; j < 32; j++) {
+			if (!p1[j])
+				continue;
+			q1[j] = kmalloc(64*sizeof(u16), GFP_KERNEL);
+			if (!q1[j])
+				return -ENOMEM;
+			memcpy(q1[j], p1[j], 64*sizeof(u16));
+		}
+	}
+	q->hash = p->hash;
 	return 0;
 }
 
@@ -455,7 +676,6 @@ int con_clear_unimap(struct vc_data *vc, struct unimapinit *ui)
 	} else {
 		if (p == dflt) dflt = NULL;
 		p->refcount++;
-		p->sum = 0;
 		con_release_unimap(p);
 	}
 	return 0;
@@ -464,52 +684,61 @@ int con_clear_unimap(struct vc_data *vc, struct unimapinit *ui)
 int con_set_unimap(struct vc_data *vc, ushort ct, struct unipair __user *list)
 {
 	struct uni_pagedir *p, *q;
-	int err = 0, err1, i;
+	struct unipair *pairs;
+	int err = 0, err1, i, n;
 	
 	p = (struct uni_pagedir *)*vc->vc_uni_pagedir_loc;
 	if (p->readonly) return -EIO;
 	
 	if (!ct) return 0;
+
+	/* the list is loaded in page sized batches */
+	pairs = kmalloc(UNIPAIR_BATCH * sizeof(struct unipair), GFP_KERNEL);
+	if (!pairs)
+		return -ENOMEM;
 	
 	if (p->refcount > 1) {
-		int j, k;
-		u16 **p1, *p2, l;
-		
 		err1 = con_clear_unimap(vc, NULL);
-		if (err1) return err1;
+		if (err1) {
+			kfree(pairs);
+			return err1;
+		}
 		
 		q = (struct uni_pagedir *)*vc->vc_uni_pagedir_loc;
-		for (i = 0, l = 0; i < 32; i++)
-		if ((p1 = p->uni_pgdir[i]))
-			for (j = 0; j < 32; j++)
-			if ((p2 = p1[j]))
-				for (k = 0; k < 64; k++, l++)
-				if (p2[k] != 0xffff) {
-					err1 = con_insert_unipair(q, l, p2[k]);
-					if (err1) {
-						p->refcount++;
-						*vc->vc_uni_pagedir_loc = (unsigned long)p;
-						con_release_unimap(q);
-						kfree(q);
-						return err1; 
-					}
-              			}
+		err1 = con_copy_unipages(q, p);
+		if (err1) {
+			p->refcount++;
+			*vc->vc_uni_pagedir_loc = (unsigned long)p;
+			con_release_unimap(q);
+			kfree(q);
+			kfree(pairs);
+			return err1; 
+		}
               	p = q;
-	} else if (p == dflt)
-		dflt = NULL;
+	} else {
+		if (p == dflt)
+			dflt = NULL;
+		unimap_unhash(p);
+		con_free_glyphs(p);
+	}
 	
-	while (ct--) {
-		unsigned short unicode, fontpos;
-		__get_user(unicode, &list->unicode);
-		__get_user(fontpos, &list->fontpos);
-		if ((err1 = con_insert_unipair(p, unicode,fontpos)) != 0)
+	while (ct) {
+		n = min_t(int, ct, UNIPAIR_BATCH);
+		if (copy_from_user(pairs, list, n * sizeof(struct unipair))) {
+			err = -EFAULT;
+			break;
+		}
+		if ((err1 = con_insert_unipairs(p, pairs, n)) != 0)
 			err = err1;
-			list++;
+		list += n;
+		ct -= n;
 	}
+	kfree(pairs);
 	
 	if (con_unify_unimap(vc, p))
 		return err;
 
+	con_build_glyphs(p);
 	for (i = 0; i <= 3; i++)
 		set_inverse_transl(vc, p, i); /* Update all inverse translations */
 	return err;
@@ -532,7 +761,7 @@ int con_set_default_unimap(struct vc_data *vc)
 			return 0;
 		dflt->refcount++;
 		*vc->vc_uni_pagedir_loc = (unsigned long)dflt;
-		if (p && --p->refcount) {
+		if (p && !--p->refcount) {
 			con_release_unimap(p);
 			kfree(p);
 		}
@@ -558,6 +787,7 @@ int con_set_default_unimap(struct vc_data *vc)
 		return err;
 	}
 
+	con_build_glyphs(p);
 	for (i = 0; i <= 3; i++)
 		set_inverse_transl(vc, p, i);	/* Update all inverse translations */
 	dflt = p;
@@ -619,13 +849,13 @@ int
 conv_uni_to_pc(struct vc_data *vc, long ucs) 
 {
 	int h;
-	u16 **p1, *p2;
+	u16 **p1, *p2, *idx;
 	struct uni_pagedir *p;
+	struct uni_glyphs *g;
   
-	/* Only 16-bit codes supported at this time */
-	if (ucs > 0xffff)
+	if (ucs > 0x10ffff)
 		ucs = 0xfffd;		/* U+FFFD: REPLACEMENT CHARACTER */
-	else if (ucs < 0x20 || ucs >= 0xfffe)
+	else if (ucs < 0x20 || ucs == 0xfffe || ucs == 0xffff)
 		return -1;		/* Not a printable character */
 	else if (ucs == 0xfeff || (ucs >= 0x200a && ucs <= 0x200f))
 		return -2;			/* Zero-width space */
@@ -641,6 +871,19 @@ conv_uni_to_pc(struct vc_data *vc, long ucs)
 		return -3;
 
 	p = (struct uni_pagedir *)*vc->vc_uni_pagedir_loc;  
+	if ((g = p->glyphs)) {
+		idx = g->plane[ucs >> 16];
+		if (idx && (h = g->pages[(idx[(ucs >> 8) & 0xff] << 8) |
+					 (ucs & 0xff)]) < MAX_GLYPH)
+			return h;
+		if (ucs > 0xffff && g->replacement < MAX_GLYPH)
+			return g->replacement;
+		return -4;
+	}
+
+	/* Only 16-bit codes in the paged table */
+	if (ucs > 0xffff)
+		ucs = 0xfffd;
 	if ((p1 = p->uni_pgdir[ucs >> 11]) &&
 	    (p2 = p1[(ucs >> 6) & 0x1f]) &&
 	    (h = p2[ucs & 0x3f]) < MAX_GLYPH)
@@ -226,6 +226,7 @@ void vte_ed(struct vc_data *vc, int vpar)
 		return;
 	}
 	scr_memsetw(start, vc->vc_video_erase_char, 2 * count);
+	vc_uniscr_fill(vc, ((unsigned long) start - vc->vc_origin) >> 1, ' ', count);
 	vc->vc_need_wrap = 0;
 }
 
@@ -257,6 +258,7 @@ static void vte_el(struct vc_data *vc, int vpar)
 		return;
 	}
 	scr_memsetw(start, vc->vc_video_erase_char, 2 * count);
+	vc_uniscr_fill(vc, ((unsigned long) start - vc->vc_origin) >> 1, ' ', count);
 	vc->vc_need_wrap = 0;
 }
 
@@ -273,6 +275,7 @@ static void vte_ech(struct vc_data *vc, int vpar)
 		vpar++;
 	count = (vpar > vc->vc_cols - vc->vc_x) ? (vc->vc_cols - vc->vc_x) : vpar;
 	scr_memsetw((unsigned short *) vc->vc_pos, vc->vc_video_erase_char, 2 * count);
+	vc_uniscr_fill(vc, (vc->vc_pos - vc->vc_origin) >> 1, ' ', count);
 	clear_region(vc, vc->vc_x, vc->vc_y, count, 1);
 	vc->vc_need_wrap = 0;
 }
@@ -1092,8 +1095,7 @@ void terminal_emulation(struct tty_struct *tty, int c)
 	case 0x06:		/* ACK - Acknowledge */
 		return;
 	case 0x07:		/* BEL - Bell */
-		if (vc->vc_bell_duration)
-			kd_mksound(vc->display_fg->beeper, vc->vc_bell_pitch, vc->vc_bell_duration);
+		vc_bell(vc);
 		return;
 	case 0x08:		/* BS - Back space */
 		vte_bs(vc);
@@ -1931,6 +1933,7 @@ void terminal_emulation(struct tty_struct *tty, int c)
 			/* DEC screen alignment test. kludge :-) */
 			vc->vc_video_erase_char = (vc->vc_video_erase_char & 0xff00) | 'E';
 			vte_ed(vc, 2);
+			vc_uniscr_fill(vc, 0, 'E', vc->vc_cols * vc->vc_rows);
 			vc->vc_video_erase_char = (vc->vc_video_erase_char & 0xff00) | ' ';
 			do_update_region(vc, vc->vc_origin, vc->vc_screenbuf_size / 2);
 		}
@@ -33,11 +33,13 @@
 #include <linux/string.h>
 #include <linux/init.h>
 #include <linux/slab.h>
+#include <linux/rcupdate.h>
 
 #include <linux/kbd_diacr.h>
 #include <linux/vt_kern.h>
 #include <linux/sysrq.h>
 #include <linux/input.h>
+#include <linux/input_frame.h>
 
 static void kbd_disconnect(struct input_handle *handle);
 extern void ctrl_alt_del(void);
@@ -96,6 +98,9 @@ int shift_state = 0;
 static struct input_handler kbd_handler;
 static unsigned long key_down[NBITS(KEY_MAX)];		/* keyboard key bitmap */
 static unsigned char shift_down[NR_SHIFT];		/* shift state counters.. */
+static unsigned char shift_key[NR_KEYS];		/* modifier + 1 held by key */
+static unsigned int shift_keycode;			/* key k_shift() acts on */
+static char shift_released;				/* release changed shift_state */
 static int dead_key_next;
 static int npadch = -1;					/* -1 or number assembled on pad */
 static unsigned char diacr;
@@ -223,19 +228,119 @@ int kbd_rate(struct input_handle *handle, struct kbd_repeat *rep)
 	return 0;
 }
 
+/*
+ * A VC that set its own repeat rate gets it back when it comes to the
+ * foreground, the others get the defaults of the input core.
+ */
+void kbd_vc_rate(struct vc_data *vc)
+{
+	struct input_handle *handle = vc->display_fg->keyboard;
+	struct kbd_repeat rep;
+
+	if (!handle)
+		return;
+	rep.delay  = vc->kbd_rep_delay  ? vc->kbd_rep_delay  : INPUT_REP_DELAY_DEFAULT;
+	rep.period = vc->kbd_rep_period ? vc->kbd_rep_period : INPUT_REP_PERIOD_DEFAULT;
+	kbd_rate(handle, &rep);
+}
+
+struct kbd_handle {
+	struct input_handle handle;
+	struct input_cursor cursor;
+	unsigned int count;		/* key events pending in the ring */
+	int synced;			/* the device ends its frames */
+	struct tty_struct *flip_tty;	/* has characters not pushed yet */
+	unsigned long long frame_stamp;	/* frame processing began, for latency */
+};
+
 /*
  * Helper Functions.
+ *
+ * Characters typed are only put into the flip buffer here; the flip is
+ * pushed once at the end of the input frame by kbd_flip().  The frame
+ * belongs to the keyboard of the VT the characters go to.
+ */
+static inline struct kbd_handle *kbd_handle_of(struct vt_struct *vt)
+{
+	struct input_handle *handle = vt->keyboard;
+
+	return handle ? container_of(handle, struct kbd_handle, handle) : NULL;
+}
+
+/*
+ * Counts a delay since start in the latency histograms of vt.
  */
+static void kbd_latency_add(struct vt_struct *vt, int stage, unsigned long long start)
+{
+	unsigned long us = (unsigned long) ((sched_clock() - start) >> 10);
+	int bucket = fls(us);
+
+	if (bucket >= KBD_LAT_BUCKETS)
+		bucket = KBD_LAT_BUCKETS - 1;
+	vt->vt_latency->hist[stage][bucket]++;
+}
+
+static void kbd_flip(struct kbd_handle *kh)
+{
+	struct tty_struct *tty = kh->flip_tty;
+	struct vc_data *vc;
+
+	if (!tty)
+		return;
+	vc = tty->driver_data;
+	if (vc && vc->display_fg->vt_latency_on) {
+		if (kh->frame_stamp)
+			kbd_latency_add(vc->display_fg, KBD_LAT_QUEUE, kh->frame_stamp);
+		vc->kbd_flip_stamp = sched_clock();
+	}
+	schedule_work(&tty->flip.work);
+	kh->flip_tty = NULL;
+}
+
+/*
+ * Called by flush_to_ldisc() for a console tty just before its flip
+ * reaches the line discipline.
+ */
+void kbd_flip_received(struct tty_struct *tty)
+{
+	struct vc_data *vc = tty->driver_data;
+
+	if (!vc)
+		return;
+	if (vc->kbd_flip_stamp && vc->display_fg->vt_latency_on)
+		kbd_latency_add(vc->display_fg, KBD_LAT_LDISC, vc->kbd_flip_stamp);
+	vc->kbd_flip_stamp = 0;
+}
+
 static void put_queue(struct vc_data *vc, int ch)
 {
 	struct tty_struct *tty = vc->vc_tty;
+	struct kbd_handle *kh = kbd_handle_of(vc->display_fg);
 
-	if (tty) {
-		tty_insert_flip_char(tty, ch, 0);
+	if (!tty)
+		return;
+	if (tty->flip.count >= TTY_FLIPBUF_SIZE) {
+		vc->kbd_overruns++;
+		return;
+	}
+	tty_insert_flip_char(tty, ch, 0);
+	if (!kh)
 		schedule_work(&tty->flip.work);
+	else if (kh->flip_tty != tty) {
+		kbd_flip(kh);
+		kh->flip_tty = tty;
 	}
 }
 
+static void kbd_puts(struct vc_data *vc, char *cp)
+{
+	while (*cp)
+		put_queue(vc, *cp++);
+}
+
+/*
+ * For replies of the terminal emulation, outside of any input frame.
+ */
 void puts_queue(struct vc_data *vc, char *cp)
 {
 	struct tty_struct *tty = vc->vc_tty;
@@ -244,6 +349,10 @@ void puts_queue(struct vc_data *vc, char *cp)
 		return;
 
 	while (*cp) {
+		if (tty->flip.count >= TTY_FLIPBUF_SIZE) {
+			vc->kbd_overruns += strlen(cp);
+			break;
+		}
 		tty_insert_flip_char(tty, *cp, 0);
 		cp++;
 	}
@@ -256,7 +365,7 @@ static void applkey(struct vc_data *vc, int key, char mode)
 
 	buf[1] = (mode ? 'O' : '[');
 	buf[2] = key;
-	puts_queue(vc, buf);
+	kbd_puts(vc, buf);
 }
 
 /*
@@ -283,10 +392,11 @@ static void to_utf8(struct vc_data *vc, ushort c)
     	}
 }
 
-/* 
- * Called after returning from RAW mode or when changing consoles - recompute
- * shift_down[] and shift_state from key_down[] maybe called when keymap is
- * undefined, so that shiftkey release is seen
+/*
+ * Rebuilds shift_down[], shift_state and shift_key[] from key_down[] and
+ * the plain keymap.  k_shift() and kbd_keycode() keep them up to date, so
+ * this is only needed when keys disappear without being released, as
+ * when a keyboard is unplugged, or when asked for with fn_null.
  */
 void compute_shiftstate(void)
 {
@@ -294,15 +404,16 @@ void compute_shiftstate(void)
 
 	shift_state = 0;
 	memset(shift_down, 0, sizeof(shift_down));
+	memset(shift_key, 0, sizeof(shift_key));
 	
-	for (i = 0; i < ARRAY_SIZE(key_down); i++) {
+	for (i = 0; i < ARRAY_SIZE(key_down) && i * BITS_PER_LONG < NR_KEYS; i++) {
 
 		if (!key_down[i])
 			continue;
 
 		k = i * BITS_PER_LONG;
 
-		for (j = 0; j < BITS_PER_LONG; j++, k++) {
+		for (j = 0; j < BITS_PER_LONG && k < NR_KEYS; j++, k++) {
 
 			if (!test_bit(k, key_down))
 				continue;
@@ -315,12 +426,131 @@ void compute_shiftstate(void)
 			if (val == KVAL(K_CAPSSHIFT))
 				val = KVAL(K_SHIFT);
 
+			shift_key[k] = val + 1;
 			shift_down[val]++;
 			shift_state |= (1 << val);
 		}
 	}
 }
 
+/*
+ * Drops the modifier a key held down, returns 1 if that changed shift_state
+ */
+static int shift_release(unsigned int keycode)
+{
+	int val = shift_key[keycode] - 1;
+
+	shift_key[keycode] = 0;
+	if (shift_down[val] && --shift_down[val])
+		return 0;
+	shift_state &= ~(1 << val);
+	return 1;
+}
+
+/*
+ * Compose table index: a row of 256 results for each dead key in use,
+ * indexed by the base character.  Slots hold result + 1, or 0 where the
+ * pair does not compose.  As with the old linear scan, the first entry
+ * for a pair wins.
+ */
+struct kbd_diacr_index {
+	unsigned int count;
+	unsigned short *rows[256];
+};
+
+static struct kbd_diacr_index *diacr_index;
+
+void kbd_diacr_free(struct kbd_diacr_index *index)
+{
+	int i;
+
+	if (!index)
+		return;
+	for (i = 0; i < 256; i++)
+		if (index->rows[i])
+			kfree(index->rows[i]);
+	kfree(index);
+}
+
+struct kbd_diacr_index *kbd_diacr_build(const struct kbdiacr *table, unsigned int n)
+{
+	struct kbd_diacr_index *index;
+	unsigned short *row;
+	unsigned int i;
+
+	index = kmalloc(sizeof(*index), GFP_KERNEL);
+	if (!index)
+		return NULL;
+	memset(index, 0, sizeof(*index));
+
+	for (i = 0; i < n; i++) {
+		if (!(row = index->rows[table[i].diacr])) {
+			row = kmalloc(256 * sizeof(unsigned short), GFP_KERNEL);
+			if (!row) {
+				kbd_diacr_free(index);
+				return NULL;
+			}
+			memset(row, 0, 256 * sizeof(unsigned short));
+			index->rows[table[i].diacr] = row;
+		}
+		if (!row[table[i].base]) {
+			row[table[i].base] = table[i].result + 1;
+			index->count++;
+		}
+	}
+	return index;
+}
+
+/*
+ * Puts a new index in use and returns the old one, for kbd_diacr_free()
+ * once synchronize_kernel() has let kbd_event() on other CPUs finish
+ * with it.
+ */
+struct kbd_diacr_index *kbd_diacr_install(struct kbd_diacr_index *index)
+{
+	struct kbd_diacr_index *old;
+	unsigned long flags;
+
+	smp_wmb();
+	local_irq_save(flags);
+	old = diacr_index;
+	diacr_index = index;
+	local_irq_restore(flags);
+	return old;
+}
+
+/*
+ * Copies at most max compose entries, ordered by dead key and base, to
+ * table and returns how many there are in all.
+ */
+unsigned int kbd_diacr_dump(struct kbdiacr *table, unsigned int max)
+{
+	struct kbd_diacr_index *index;
+	unsigned int d, b, n = 0;
+
+	rcu_read_lock();
+	index = diacr_index;
+	if (!index) {
+		rcu_read_unlock();
+		return 0;
+	}
+	for (d = 0; d < 256 && n < max; d++) {
+		if (!index->rows[d])
+			continue;
+		for (b = 0; b < 256 && n < max; b++) {
+			if (!index->rows[d][b])
+				continue;
+			table[n].diacr = d;
+			table[n].base = b;
+			table[n].result = index->rows[d][b] - 1;
+			n++;
+		}
+	}
+	n = index->count;
+	rcu_read_unlock();
+	return n;
+}
+
 /*
  * We have a combining character DIACR here, followed by the character CH.
  * If the combination occurs in the table, return the corresponding value.
@@ -330,15 +560,13 @@ void compute_shiftstate(void)
  */
 static unsigned char handle_diacr(struct vc_data *vc, unsigned char ch)
 {
-	unsigned int i;
+	unsigned short *row;
 	int d = diacr;
 
 	diacr = 0;
 
-	for (i = 0; i < accent_table_size; i++) {
-		if (accent_table[i].diacr == d && accent_table[i].base == ch)
-			return accent_table[i].result;
-	}
+	if (diacr_index && (row = diacr_index->rows[d]) && row[ch])
+		return row[ch] - 1;
 
 	if (ch == ' ' || ch == d)
 		return d;
@@ -606,7 +834,7 @@ static void k_fn(struct vc_data *vc, unsigned char value, char up_flag)
 	v = value;
 	if (v < ARRAY_SIZE(func_table)) {
 		if (func_table[value])
-			puts_queue(vc, func_table[value]);
+			kbd_puts(vc, func_table[value]);
 	} else
 		printk(KERN_ERR "k_fn called with value=%d\n", value);
 }
@@ -679,8 +907,6 @@ static void k_pad(struct vc_data *vc, unsigned char value, char up_flag)
 
 static void k_shift(struct vc_data *vc, unsigned char value, char up_flag)
 {
-	int old_state = shift_state;
-
 	if (rep)
 		return;
 	/*
@@ -693,23 +919,22 @@ static void k_shift(struct vc_data *vc, unsigned char value, char up_flag)
 			clr_kbd_led(&vc->kbd_table, VC_CAPSLOCK);
 	}
 
-	if (up_flag) {
-		/*
-		 * handle the case that two shift or control
-		 * keys are depressed simultaneously
-		 */
-		if (shift_down[value])
-			shift_down[value]--;
-	} else
-		shift_down[value]++;
-
-	if (shift_down[value])
-		shift_state |= (1 << value);
-	else
-		shift_state &= ~(1 << value);
+	/*
+	 * Modifiers are counted by the key holding them, so that two shift
+	 * or control keys depressed simultaneously, or a key remapped while
+	 * held, come up right.  kbd_keycode() has already counted releases.
+	 */
+	if (!up_flag) {
+		if (!shift_key[shift_keycode]) {
+			shift_key[shift_keycode] = value + 1;
+			shift_down[value]++;
+			shift_state |= (1 << value);
+		}
+		return;
+	}
 
 	/* kludge */
-	if (up_flag && shift_state != old_state && npadch != -1) {
+	if (shift_released && npadch != -1) {
 		if (vc->kbd_table.kbdmode == VC_UNICODE)
 			to_utf8(vc, npadch & 0xffff);
 		else
@@ -837,9 +1062,21 @@ static inline unsigned char getleds(struct vc_data *vc)
  * interrupt routines for this thing allows us to easily mask
  * this when we don't want any of the above to happen.
  * This allows for easy and efficient race-condition prevention
- * for kbd_refresh_leds => input_event(dev, EV_LED, ...) => ...
+ * for kbd_refresh_leds => input_events(dev, EV_LED, ...) => ...
  */
 
+static void kbd_set_leds(struct input_handle *handle, unsigned char leds)
+{
+	struct input_value vals[] = {
+		{ EV_LED, LED_SCROLLL, !!(leds & 0x01) },
+		{ EV_LED, LED_NUML,    !!(leds & 0x02) },
+		{ EV_LED, LED_CAPSL,   !!(leds & 0x04) },
+		{ EV_SYN, SYN_REPORT,  0 },
+	};
+
+	input_events(handle->dev, vals, ARRAY_SIZE(vals));
+}
+
 static void kbd_bh(unsigned long dummy)
 {
 	struct list_head * node;
@@ -853,10 +1090,7 @@ static void kbd_bh(unsigned long dummy)
 			leds = getleds(vt->fg_console);
 
 			if (leds != vt->vt_ledstate) {
-				input_event(handle->dev, EV_LED, LED_SCROLLL, !!(leds & 0x01));
-				input_event(handle->dev, EV_LED, LED_NUML,    !!(leds & 0x02));
-				input_event(handle->dev, EV_LED, LED_CAPSL,   !!(leds & 0x04));
-				input_sync(handle->dev);
+				kbd_set_leds(handle, leds);
 				vt->vt_ledstate = leds;
 			}
 		}
@@ -878,10 +1112,7 @@ static void kbd_refresh_leds(struct input_handle *handle)
 		leds = getleds(vt->fg_console);
 			
 		if (leds != vt->vt_ledstate) {
-			input_event(handle->dev, EV_LED, LED_SCROLLL, !!(leds & 0x01));
-			input_event(handle->dev, EV_LED, LED_NUML,    !!(leds & 0x02));
-			input_event(handle->dev, EV_LED, LED_CAPSL,   !!(leds & 0x04));
-			input_sync(handle->dev);
+			kbd_set_leds(handle, leds);
 			vt->vt_ledstate = leds;
 		}
 		tasklet_enable(&keyboard_tasklet);
@@ -1058,6 +1289,11 @@ static void kbd_keycode(struct vt_struct *vt, unsigned int keycode, int down, in
 	else
 		clear_bit(keycode, key_down);
 
+	/* whatever the key means now, let go of the modifier it pressed */
+	shift_released = 0;
+	if (!down && keycode < NR_KEYS && shift_key[keycode])
+		shift_released = shift_release(keycode);
+
 	if (rep && (!get_kbd_mode(&vc->kbd_table, VC_REPEAT) || (tty && 
 		(!L_ECHO(tty) && tty->driver->chars_in_buffer(tty))))) {
 		/*
@@ -1072,12 +1308,11 @@ static void kbd_keycode(struct vt_struct *vt, unsigned int keycode, int down, in
 	key_map = key_maps[shift_final];
 
 	if (!key_map) {
-		compute_shiftstate();
 		vc->kbd_table.slockstate = 0;
 		return;
 	}
 
-	if (keycode > NR_KEYS)
+	if (keycode >= NR_KEYS)
 		return;
 
 	keysym = key_map[keycode];
@@ -1102,26 +1337,85 @@ static void kbd_keycode(struct vt_struct *vt, unsigned int keycode, int down, in
 		}
 	}
 
+	shift_keycode = keycode;
 	(*k_handler[type])(vc, keysym & 0xff, !down);
 
 	if (type != KT_SLOCK)
 		vc->kbd_table.slockstate = 0;
 }
 
+/*
+ * Key and raw events are left in the device's event ring until the
+ * SYN_REPORT ending the frame, so that the bottom half and the VT work
+ * are scheduled once per frame instead of once per event.  Frames that
+ * carry no keys, like LED echoes or scan codes, schedule nothing.  A
+ * device that has never sent SYN_REPORT gets its keys handled at once.
+ */
+#define KBD_FRAME_EVENTS	16
+
+static void kbd_frame_flush(struct kbd_handle *kh)
+{
+	struct vt_struct *vt = kh->handle.private;
+	int raw = HW_RAW(kh->handle.dev);
+	struct input_ring_event ev;
+	struct kbd_handle *owner;
+
+	if (!kh->count)
+		return;
+	kh->count = 0;
+	if (!vt)		/* unmapped meanwhile */
+		return;
+	owner = kbd_handle_of(vt);	/* not kh for a shared beeper */
+	if (owner && vt->vt_latency_on)
+		owner->frame_stamp = sched_clock();
+	while (input_cursor_read(&kh->cursor, &ev)) {
+		if (ev.type == EV_KEY)
+			kbd_keycode(vt, ev.code, ev.value, raw);
+		else if (ev.type == EV_MSC && ev.code == MSC_RAW && raw)
+			kbd_rawcode(vt->fg_console, ev.value);
+		else
+			continue;
+		if (vt->vt_latency_on)
+			kbd_latency_add(vt, KBD_LAT_INPUT, ev.stamp);
+	}
+
+	if (owner) {
+		kbd_flip(owner);
+		owner->frame_stamp = 0;
+	}
+	tasklet_schedule(&keyboard_tasklet);
+	do_poke_blanked_console = 1;
+	schedule_work(&vt->vt_work);
+}
+
 static void kbd_event(struct input_handle *handle, unsigned int event_type, 
 		      unsigned int event_code, int value)
 {
+	struct kbd_handle *kh = container_of(handle, struct kbd_handle, handle);
 	struct vt_struct *vt = handle->private;
 
 	if (!vt)
 		return;
-	if (event_type == EV_MSC && event_code == MSC_RAW && HW_RAW(handle->dev))
-		kbd_rawcode(vt->fg_console, value);
-	if (event_type == EV_KEY)
-		kbd_keycode(vt, event_code, value, HW_RAW(handle->dev));
-	tasklet_schedule(&keyboard_tasklet);
-	do_poke_blanked_console = 1;
-	schedule_work(&vt->vt_work);
+	if (event_type == EV_KEY ||
+	    (event_type == EV_MSC && event_code == MSC_RAW && HW_RAW(handle->dev))) {
+		/* whatever came while the device was grabbed is not ours */
+		if (!kh->count)
+			input_cursor_frame(&kh->cursor);
+		if (++kh->count == KBD_FRAME_EVENTS || !kh->synced)
+			kbd_frame_flush(kh);
+	} else if (event_type == EV_SYN && event_code == SYN_REPORT) {
+		kh->synced = 1;
+		kbd_frame_flush(kh);
+	}
+}
+
+static void kbd_events(struct input_handle *handle, struct input_value *vals,
+		       unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		kbd_event(handle, vals[i].type, vals[i].code, vals[i].value);
 }
 
 static char kbd_name[] = "kbd";
@@ -1138,6 +1432,7 @@ static struct input_handle *kbd_connect(struct input_handler *handler,
 {
 	struct vt_struct *vt = NULL;
 	struct input_handle *handle;
+	struct kbd_handle *kh;
 	int i;
 
 	for (i = KEY_RESERVED; i < BTN_MISC; i++)
@@ -1146,9 +1441,14 @@ static struct input_handle *kbd_connect(struct input_handler *handler,
 	if ((i == BTN_MISC) && !test_bit(EV_SND, dev->evbit)) 
 		return NULL;
 
-	if (!(handle = kmalloc(sizeof(struct input_handle), GFP_KERNEL))) 
+	if (!(kh = kmalloc(sizeof(struct kbd_handle), GFP_KERNEL))) 
 		return NULL;
-	memset(handle, 0, sizeof(struct input_handle));
+	memset(kh, 0, sizeof(struct kbd_handle));
+	if (input_cursor_attach(&kh->cursor, dev)) {
+		kfree(kh);
+		return NULL;
+	}
+	handle = &kh->handle;
 
 	handle->dev = dev;
 	handle->handler = handler;
@@ -1192,13 +1492,23 @@ static struct input_handle *kbd_connect(struct input_handler *handler,
 static void kbd_disconnect(struct input_handle *handle)
 {
 	struct vt_struct *vt = handle->private;
+	unsigned long flags;
+	int i;
 
 	if (vt && vt->keyboard == handle) {
 		vt->keyboard = NULL;
 		handle->private = NULL;
+		/* its keys will never come up, start over */
+		local_irq_save(flags);
+		for (i = 0; i < ARRAY_SIZE(key_down); i++)
+			key_down[i] &= ~handle->dev->key[i];
+		compute_shiftstate();
+		kbd_flip(container_of(handle, struct kbd_handle, handle));
+		local_irq_restore(flags);
 	}	
 	input_close_device(handle);
-	kfree(handle);
+	input_cursor_detach(&container_of(handle, struct kbd_handle, handle)->cursor);
+	kfree(container_of(handle, struct kbd_handle, handle));
 }
 
 static struct input_device_id kbd_ids[] = {
@@ -1225,8 +1535,15 @@ static struct input_handler kbd_handler = {
 	.id_table	= kbd_ids,
 };
 
+static struct input_batch kbd_batch = {
+	.handler	= &kbd_handler,
+	.events		= kbd_events,
+};
+
 int __init kbd_init(void)
 {
+	kbd_diacr_install(kbd_diacr_build(accent_table, accent_table_size));
+	input_register_batch(&kbd_batch);
 	input_register_handler(&kbd_handler);
 	tasklet_enable(&keyboard_tasklet);
 	tasklet_schedule(&keyboard_tasklet);
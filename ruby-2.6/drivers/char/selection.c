@@ -6,6 +6,7 @@
  *     'int set_selection(struct tiocl_selection __user *, struct tty_struct *)'
  *     'void clear_selection(void)'
  *     'int paste_selection(struct tty_struct *)'
+ *     'void paste_cancel(struct vc_data *)'
  *     'int sel_loadlut(char __user *)'
  *
  * Now that /dev/vcs exists, most of this can disappear again.
@@ -17,6 +18,7 @@
 #include <linux/mm.h>
 #include <linux/slab.h>
 #include <linux/types.h>
+#include <linux/workqueue.h>
 
 #include <asm/uaccess.h>
 
@@ -34,6 +36,7 @@
 struct vc_data *sel_cons;		/* must not be disallocated */
 static volatile int sel_start = -1; 	/* cleared by clear_selection */
 static int sel_end;
+static int sel_unicode;			/* selection copied as UTF-8 */
 static int sel_buffer_lth;
 static char *sel_buffer;
 
@@ -62,10 +65,27 @@ static inline void highlight_pointer(const int where)
 	complement_pos(sel_cons, where);
 }
 
-static unsigned char
-sel_pos(int n)
+static int
+store_utf8(u32 c, char *p)
 {
-	return inverse_translate(sel_cons, screen_glyph(sel_cons, n));
+	if (c < 0x80) {
+		p[0] = c;
+		return 1;
+	} else if (c < 0x800) {
+		p[0] = 0xc0 | (c >> 6);
+		p[1] = 0x80 | (c & 0x3f);
+		return 2;
+	} else if (c < 0x10000) {
+		p[0] = 0xe0 | (c >> 12);
+		p[1] = 0x80 | ((c >> 6) & 0x3f);
+		p[2] = 0x80 | (c & 0x3f);
+		return 3;
+	}
+	p[0] = 0xf0 | (c >> 18);
+	p[1] = 0x80 | ((c >> 12) & 0x3f);
+	p[2] = 0x80 | ((c >> 6) & 0x3f);
+	p[3] = 0x80 | (c & 0x3f);
+	return 4;
 }
 
 /* 
@@ -96,20 +116,99 @@ static u32 inwordLut[8]={
   0xFF7FFFFF  /* latin-1 accented letters, not division sign */
 };
 
-static inline int inword(const unsigned char c) {
-	return ( inwordLut[c>>5] >> (c & 0x1F) ) & 1;
+/*
+ * inwordLut and isspace() folded into one byte per character, so the
+ * word scan is a single table lookup per cell.  Rebuilt whenever
+ * inwordLut changes.
+ */
+#define SEL_WORD	1
+#define SEL_SPACE	2
+
+static unsigned char sel_class[256];
+static int sel_class_valid;
+
+static void sel_build_class(void)
+{
+	int c;
+
+	for (c = 0; c < 256; c++)
+		sel_class[c] = (((inwordLut[c>>5] >> (c & 0x1F)) & 1) ? SEL_WORD : 0) |
+			       (isspace(c) ? SEL_SPACE : 0);
+	sel_class_valid = 1;
+}
+
+static inline int sel_class_of(const u32 c)
+{
+	return c > 0xff ? SEL_WORD : sel_class[c];
 }
 
 /* set inwordLut contents. Invoked by ioctl(). */
 int sel_loadlut(char __user *p)
 {
-	return copy_from_user(inwordLut, (u32 __user *)(p+4), 32) ? -EFAULT : 0;
+	u32 lut[8];
+
+	if (copy_from_user(lut, (u32 __user *)(p+4), 32))
+		return -EFAULT;
+	acquire_console_sem();
+	memcpy(inwordLut, lut, 32);
+	sel_build_class();
+	release_console_sem();
+	return 0;
 }
 
-/* does screen address p correspond to character at LH/RH edge of screen? */
-static inline int atedge(const int p, int size_row)
+/*
+ * Row buffer for the scans below.  Only used under the console
+ * semaphore, grown to the widest console seen so far.
+ */
+static u32 *sel_row;
+static unsigned int sel_row_len;
+
+static int sel_row_alloc(unsigned int cols)
 {
-	return (!(p % size_row)	|| !((p + 2) % size_row));
+	u32 *row;
+
+	if (cols <= sel_row_len)
+		return 0;
+	row = kmalloc(cols * sizeof(u32), GFP_KERNEL);
+	if (!row)
+		return -ENOMEM;
+	if (sel_row)
+		kfree(sel_row);
+	sel_row = row;
+	sel_row_len = cols;
+	return 0;
+}
+
+/*
+ * Read @n characters starting at screen offset @offset into sel_row.
+ * The run must not cross a row, so that one screenpos() covers it.
+ * UTF-8 consoles are read as Unicode (exact if the VT keeps a shadow
+ * screen), the others as 8-bit codes of their current character set.
+ */
+static void sel_fetch(int offset, int n)
+{
+	struct vc_data *vc = sel_cons;
+	const unsigned char *inv = inverse_translate_map(vc);
+	u16 *p = screenpos(vc, offset, 1);
+	u32 *uni = NULL;
+	int k;
+
+	if (sel_unicode && vc->vc_uni_screen &&
+	    vc->vc_visible_origin == vc->vc_origin)
+		uni = vc->vc_uni_screen + (offset >> 1);
+
+	for (k = 0; k < n; k++) {
+		u16 w = scr_readw(p + k);
+		u16 g = w & 0xff;
+
+		if (uni && uni[k]) {
+			sel_row[k] = uni[k];
+			continue;
+		}
+		if (w & vc->vc_hi_font_mask)
+			g |= 0x100;
+		sel_row[k] = inv ? inv[g] : (g & 0xff);
+	}
 }
 
 /* constrain v such that v <= u */
@@ -122,9 +221,9 @@ static inline unsigned short limit(const unsigned short v, const unsigned short
 int set_selection(const struct tiocl_selection __user *sel, struct tty_struct *tty)
 {
 	struct vc_data *vc = (struct vc_data *) tty->driver_data;
-	int sel_mode, new_sel_start, new_sel_end, spc;
-	char *bp, *obp;
-	int i, ps, pe;
+	int sel_mode, new_sel_start, new_sel_end, mask;
+	int ps, pe, i, k, n, col, row_end, last;
+	char *bp;
 
 	poke_blanked_console(vc->display_fg);
 
@@ -168,6 +267,11 @@ int set_selection(const struct tiocl_selection __user *sel, struct tty_struct *t
 		clear_selection();
 		sel_cons = vc->display_fg->fg_console;
 	}
+	sel_unicode = sel_cons->vc_utf;
+	if (!sel_class_valid)
+		sel_build_class();
+	if (sel_row_alloc(sel_cons->vc_cols))
+		return -ENOMEM;
 
 	switch (sel_mode)
 	{
@@ -176,26 +280,25 @@ int set_selection(const struct tiocl_selection __user *sel, struct tty_struct *t
 			new_sel_end = pe;
 			break;
 		case TIOCL_SELWORD:	/* word-by-word selection */
-			spc = isspace(sel_pos(ps));
-			for (new_sel_start = ps; ; ps -= 2)
-			{
-				if ((spc && !isspace(sel_pos(ps))) ||
-				    (!spc && !inword(sel_pos(ps))))
-					break;
-				new_sel_start = ps;
-				if (!(ps % vc->vc_size_row))
-					break;
-			}
-			spc = isspace(sel_pos(pe));
-			for (new_sel_end = pe; ; pe += 2)
-			{
-				if ((spc && !isspace(sel_pos(pe))) ||
-				    (!spc && !inword(sel_pos(pe))))
-					break;
-				new_sel_end = pe;
-				if (!((pe + 2) % vc->vc_size_row))
-					break;
-			}
+			/* scan left within the row of ps */
+			col = (ps % vc->vc_size_row) >> 1;
+			sel_fetch(ps - (col << 1), col + 1);
+			mask = (sel_class_of(sel_row[col]) & SEL_SPACE) ? SEL_SPACE : SEL_WORD;
+			k = col;
+			if (sel_class_of(sel_row[k]) & mask)
+				while (k > 0 && (sel_class_of(sel_row[k - 1]) & mask))
+					k--;
+			new_sel_start = ps - ((col - k) << 1);
+
+			/* scan right within the row of pe */
+			n = vc->vc_cols - ((pe % vc->vc_size_row) >> 1);
+			sel_fetch(pe, n);
+			mask = (sel_class_of(sel_row[0]) & SEL_SPACE) ? SEL_SPACE : SEL_WORD;
+			k = 0;
+			if (sel_class_of(sel_row[k]) & mask)
+				while (k + 1 < n && (sel_class_of(sel_row[k + 1]) & mask))
+					k++;
+			new_sel_end = pe + (k << 1);
 			break;
 		case TIOCL_SELLINE:	/* line-by-line selection */
 			new_sel_start = ps - ps % vc->vc_size_row;
@@ -212,45 +315,41 @@ int set_selection(const struct tiocl_selection __user *sel, struct tty_struct *t
 	/* remove the pointer */
 	highlight_pointer(-1);
 
-	/* select to end of line if on trailing space */
-	if (new_sel_end > new_sel_start &&
-		!atedge(new_sel_end, vc->vc_size_row) &&
-		isspace(sel_pos(new_sel_end))) {
-		for (pe = new_sel_end + 2; ; pe += 2)
-			if (!isspace(sel_pos(pe)) ||
-			    atedge(pe, vc->vc_size_row))
-				break;
-		if (isspace(sel_pos(pe)))
-			new_sel_end = pe;
+	/* select to end of line if only spaces follow */
+	if (new_sel_end > new_sel_start) {
+		row_end = new_sel_end - new_sel_end % vc->vc_size_row
+			  + vc->vc_size_row - 2;
+		n = ((row_end - new_sel_end) >> 1) + 1;
+		if (new_sel_end % vc->vc_size_row && n > 1) {
+			sel_fetch(new_sel_end, n);
+			for (k = 0; k < n && (sel_class_of(sel_row[k]) & SEL_SPACE); k++)
+				;
+			if (k == n)
+				new_sel_end = row_end;
+		}
 	}
+
+	/* invert only the cells whose state changes */
 	if (sel_start == -1)	/* no current selection */
 		highlight(new_sel_start, new_sel_end);
-	else if (new_sel_start == sel_start)
-	{
-		if (new_sel_end == sel_end)	/* no action required */
-			return 0;
-		else if (new_sel_end > sel_end)	/* extend to right */
-			highlight(sel_end + 2, new_sel_end);
-		else				/* contract from right */
-			highlight(new_sel_end + 2, sel_end);
-	}
-	else if (new_sel_end == sel_end)
-	{
-		if (new_sel_start < sel_start)	/* extend to left */
-			highlight(new_sel_start, sel_start - 2);
-		else				/* contract from left */
-			highlight(sel_start, new_sel_start - 2);
-	}
-	else	/* some other case; start selection from scratch */
-	{
-		clear_selection();
+	else if (new_sel_start == sel_start && new_sel_end == sel_end)
+		return 0;	/* no action required */
+	else if (new_sel_start > sel_end || new_sel_end < sel_start) {
+		highlight(sel_start, sel_end);
 		highlight(new_sel_start, new_sel_end);
+	} else {
+		if (new_sel_start != sel_start)
+			highlight(min(new_sel_start, sel_start),
+				  max(new_sel_start, sel_start) - 2);
+		if (new_sel_end != sel_end)
+			highlight(min(new_sel_end, sel_end) + 2,
+				  max(new_sel_end, sel_end));
 	}
 	sel_start = new_sel_start;
 	sel_end = new_sel_end;
 
 	/* Allocate a new buffer before freeing the old one ... */
-	bp = kmalloc((sel_end-sel_start)/2+1, GFP_KERNEL);
+	bp = kmalloc(((sel_end-sel_start)/2+1) * (sel_unicode ? 4 : 1), GFP_KERNEL);
 	if (!bp) {
 		printk(KERN_WARNING "selection: kmalloc() failed\n");
 		clear_selection();
@@ -260,25 +359,161 @@ int set_selection(const struct tiocl_selection __user *sel, struct tty_struct *t
 		kfree(sel_buffer);
 	sel_buffer = bp;
 
-	obp = bp;
-	for (i = sel_start; i <= sel_end; i += 2) {
-		*bp = sel_pos(i);
-		if (!isspace(*bp++))
-			obp = bp;
-		if (! ((i + 2) % vc->vc_size_row)) {
-			/* strip trailing blanks from line and add newline,
-			   unless non-space at end of line. */
-			if (obp != bp) {
-				bp = obp;
-				*bp++ = '\r';
-			}
-			obp = bp;
+	/* copy a row slice at a time */
+	for (i = sel_start; i <= sel_end; i = row_end + 2) {
+		row_end = i - i % vc->vc_size_row + vc->vc_size_row - 2;
+		last = min(row_end, sel_end);
+		n = ((last - i) >> 1) + 1;
+		sel_fetch(i, n);
+		/* strip trailing blanks from line and add newline,
+		   unless non-space at end of line. */
+		k = n;
+		if (last == row_end)
+			while (k > 0 && (sel_class_of(sel_row[k - 1]) & SEL_SPACE))
+				k--;
+		if (sel_unicode) {
+			int j;
+
+			for (j = 0; j < k; j++)
+				bp += store_utf8(sel_row[j], bp);
+		} else {
+			int j;
+
+			for (j = 0; j < k; j++)
+				bp[j] = sel_row[j];
+			bp += k;
 		}
+		if (k < n)
+			*bp++ = '\r';
 	}
 	sel_buffer_lth = bp - sel_buffer;
 	return 0;
 }
 
+/*
+ * Pasting is done asynchronously: paste_selection() queues a private
+ * copy of the selection on the VC and paste_work feeds the pending
+ * pastes to their line disciplines, at most receive_room bytes per VC
+ * and run, so a large paste neither blocks the caller nor keeps
+ * keyboard input from getting through.  A throttled tty is skipped
+ * until vt_unthrottle() kicks the work again.
+ *
+ * paste_lock protects paste_list and the paste state of the VCs on it.
+ * The work takes one VC off the list and feeds it to the line discipline
+ * without the lock, as echoing goes through the console and thus
+ * console_sem, which the callers of paste_cancel() hold.  A cancel or a
+ * new paste on that VC meanwhile only clears paste_active; the work then
+ * frees the old buffer and leaves the VC, which may be gone, alone.
+ * The tty is looked up and its ldisc referenced under the lock, so that
+ * vt_close() cannot free it underneath us.
+ */
+static LIST_HEAD(paste_list);
+static spinlock_t paste_lock = SPIN_LOCK_UNLOCKED;
+static struct vc_data *paste_active;
+
+static void paste_work_fn(void *unused);
+static DECLARE_WORK(paste_work, paste_work_fn, NULL);
+
+/* paste_lock must be held, the caller frees what is returned */
+static char *paste_detach(struct vc_data *vc)
+{
+	char *buf = vc->paste_buf;
+
+	list_del_init(&vc->paste_node);
+	vc->paste_buf = NULL;
+	vc->paste_len = vc->paste_pos = 0;
+	return buf;
+}
+
+/* paste_lock must be held; ends the paste pending on vc, if any */
+static char *paste_stop(struct vc_data *vc)
+{
+	if (!vc->paste_buf)
+		return NULL;
+	vc->paste_cancelled++;
+	if (paste_active == vc) {
+		/* the work owns the buffer until it is done with it */
+		paste_active = NULL;
+		paste_detach(vc);
+		return NULL;
+	}
+	return paste_detach(vc);
+}
+
+static void paste_work_fn(void *unused)
+{
+	struct vc_data *vc;
+	struct tty_struct *tty;
+	struct tty_ldisc *ld;
+	unsigned int pos, len;
+	char *buf, *drop;
+	int count, again = 0, stalled = 0;
+	LIST_HEAD(seen);
+
+	spin_lock(&paste_lock);
+	while (!list_empty(&paste_list)) {
+		vc = list_entry(paste_list.next, struct vc_data, paste_node);
+		list_move_tail(&vc->paste_node, &seen);
+		tty = vc->vc_tty;
+		if (!tty) {
+			drop = paste_detach(vc);
+			spin_unlock(&paste_lock);
+			kfree(drop);
+			spin_lock(&paste_lock);
+			continue;
+		}
+		if (test_bit(TTY_THROTTLED, &tty->flags))
+			continue;
+		ld = tty_ldisc_ref(tty);
+		if (!ld) {
+			stalled = 1;
+			continue;
+		}
+		list_del_init(&vc->paste_node);
+		paste_active = vc;
+		buf = vc->paste_buf;
+		pos = vc->paste_pos;
+		len = vc->paste_len;
+		spin_unlock(&paste_lock);
+
+		count = min((int) (len - pos), tty->ldisc.receive_room(tty));
+		if (count > 0) {
+			tty->ldisc.receive_buf(tty, buf + pos, NULL, count);
+			again = 1;
+		} else {
+			count = 0;
+			stalled = 1;
+		}
+		tty_ldisc_deref(ld);
+
+		spin_lock(&paste_lock);
+		drop = NULL;
+		if (paste_active != vc)
+			drop = buf;		/* cancelled or replaced */
+		else {
+			vc->paste_pos += count;
+			vc->paste_bytes += count;
+			if (vc->paste_pos == vc->paste_len)
+				drop = paste_detach(vc);
+			else
+				list_add_tail(&vc->paste_node, &seen);
+		}
+		paste_active = NULL;
+		if (drop) {
+			spin_unlock(&paste_lock);
+			kfree(drop);
+			spin_lock(&paste_lock);
+		}
+	}
+	list_splice_init(&seen, &paste_list);
+	spin_unlock(&paste_lock);
+
+	if (again)
+		schedule_work(&paste_work);
+	else if (stalled)
+		schedule_delayed_work(&paste_work, 1);
+}
+
 /* Insert the contents of the selection buffer into the
  * queue of the tty associated with the current console.
  * Invoked by ioctl().
@@ -286,30 +521,55 @@ int set_selection(const struct tiocl_selection __user *sel, struct tty_struct *t
 int paste_selection(struct tty_struct *tty)
 {
 	struct	vc_data *vc = (struct vc_data *) tty->driver_data;
-	struct	tty_ldisc *ld;
-	int	pasted = 0, count;
-	DECLARE_WAITQUEUE(wait, current);
+	unsigned int len;
+	char *buf, *old;
 
 	acquire_console_sem();
 	poke_blanked_console(vc->display_fg);
+	len = sel_buffer ? sel_buffer_lth : 0;
+	if (!len) {
+		release_console_sem();
+		return 0;
+	}
+	buf = kmalloc(len, GFP_KERNEL);
+	if (!buf) {
+		release_console_sem();
+		return -ENOMEM;
+	}
+	memcpy(buf, sel_buffer, len);
 	release_console_sem();
 
-	ld = tty_ldisc_ref_wait(tty);
-	
-	add_wait_queue(&vc->paste_wait, &wait);
-	while (sel_buffer && sel_buffer_lth > pasted) {
-		set_current_state(TASK_INTERRUPTIBLE);
-		if (test_bit(TTY_THROTTLED, &tty->flags)) {
-			schedule();
-			continue;
-		}
-		count = sel_buffer_lth - pasted;
-		count = min(count, tty->ldisc.receive_room(tty));
-		tty->ldisc.receive_buf(tty, sel_buffer + pasted, NULL, count);
-		pasted += count;
-	}
-	remove_wait_queue(&vc->paste_wait, &wait);
-	set_current_state(TASK_RUNNING);
-	tty_ldisc_deref(ld);
+	spin_lock(&paste_lock);
+	old = paste_stop(vc);
+	vc->paste_buf = buf;
+	vc->paste_len = len;
+	vc->paste_pos = 0;
+	vc->paste_count++;
+	list_add_tail(&vc->paste_node, &paste_list);
+	spin_unlock(&paste_lock);
+	kfree(old);
+
+	schedule_work(&paste_work);
 	return 0;
 }
+
+/*
+ * Drop what is left of a paste on vc.  Called when the VC is switched
+ * away from, closed or freed; never waits for the paste work.
+ */
+void paste_cancel(struct vc_data *vc)
+{
+	char *buf;
+
+	spin_lock(&paste_lock);
+	buf = paste_stop(vc);
+	spin_unlock(&paste_lock);
+	kfree(buf);
+}
+
+/* The tty of vc can take input again */
+void paste_unthrottle(struct vc_data *vc)
+{
+	if (vc->paste_buf)
+		schedule_work(&paste_work);
+}
@@ -2528,6 +2528,10 @@ static void flush_to_ldisc(void *private_)
 	tty->flip.count = 0;
 	spin_unlock_irqrestore(&tty->read_lock, flags);
 
+#ifdef CONFIG_VT
+	if (tty->driver->type == TTY_DRIVER_TYPE_CONSOLE)
+		kbd_flip_received(tty);
+#endif
 	disc->receive_buf(tty, cp, fp, count);
 out:
 	tty_ldisc_deref(disc);
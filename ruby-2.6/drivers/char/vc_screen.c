@@ -11,6 +11,12 @@
  *	Attribute/character pair is in native endianity.
  *            [minor: N+128]
  *
+ * /dev/vcsuN: the characters of the screen as 32-bit Unicode values in
+ *	native endianity.  Exact when the VT keeps a Unicode shadow screen,
+ *	otherwise inverse translated from the font like /dev/vcsN.
+ *	Read only.
+ *            [minor: N+64]
+ *
  * This replaces screendump and part of selection, so that the system
  * administrator can control access using file system permissions.
  *
@@ -42,6 +48,9 @@
 
 #define HEADER_SIZE	4
 
+#define VCS_UNI		64	/* minor flag for /dev/vcsu */
+#define VCS_ATTR	128	/* minor flag for /dev/vcsa */
+
 unsigned short *screen_pos(struct vc_data *vc, int w_offset, int viewed)
 {
 	return screenpos(vc, 2 * w_offset, viewed);
@@ -76,12 +85,14 @@ void vcs_scr_writew(struct vc_data *vc, u16 val, u16 *org)
 }
 
 static int
-vcs_size(struct vc_data *vc, unsigned long attr)
+vcs_size(struct vc_data *vc, unsigned long attr, unsigned long uni)
 {
 	int size = vc->vc_rows * vc->vc_cols; 
 
 	if (attr)
 		size = 2*size + HEADER_SIZE;
+	else if (uni)
+		size *= sizeof(u32);
 	return size;
 }
 
@@ -89,11 +100,12 @@ static loff_t vcs_lseek(struct file *file, loff_t offset, int orig)
 {
 	struct inode *inode = file->f_dentry->d_inode;
 	struct vc_data *vc = file->private_data;
-	long attr = iminor(inode) & 128;
+	long attr = iminor(inode) & VCS_ATTR;
+	long uni = iminor(inode) & VCS_UNI;
 	int size;
 
 	down(&vc->display_fg->lock);
-	size = vcs_size(vc, attr);
+	size = vcs_size(vc, attr, uni);
 	switch (orig) {
 		default:
 			up(&vc->display_fg->lock);
@@ -120,7 +132,8 @@ vcs_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
 {
 	struct inode *inode = file->f_dentry->d_inode;
 	struct vc_data *vc = file->private_data;
-	long attr = iminor(inode) & 128;
+	long attr = iminor(inode) & VCS_ATTR;
+	long uni = iminor(inode) & VCS_UNI;
 	unsigned short *org = NULL;
 	long viewed, read, pos;
 	ssize_t ret = -ENXIO;
@@ -146,6 +159,9 @@ vcs_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
 	ret = -EINVAL;
 	if (pos < 0)
 		goto unlock_out;
+	/* /dev/vcsu is only read in whole characters */
+	if (uni && ((pos & 3) || count < 4))
+		goto unlock_out;
 	read = 0;
 	ret = 0;
 	while (count) {
@@ -158,7 +174,7 @@ vcs_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
 		 * as copy_to_user at the end of this loop
 		 * could sleep.
 		 */
-		size = vcs_size(vc, attr);
+		size = vcs_size(vc, attr, uni);
 		if (pos >= size)
 			break;
 		if (count > size - pos)
@@ -167,6 +183,10 @@ vcs_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
 		this_round = count;
 		if (this_round > BUF_SIZE)
 			this_round = BUF_SIZE;
+		if (uni)
+			this_round &= ~3;
+		if (!this_round)
+			break;
 
 		/* Perform the whole read into the local con_buf.
 		 * Then we can drop the console spinlock and safely
@@ -176,7 +196,12 @@ vcs_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
 		con_buf_start = con_buf0 = vc->display_fg->con_buf;
 		orig_count = this_round;
 		maxcol = vc->vc_cols;
-		if (!attr) {
+		if (uni) {
+			u32 *uni_buf = (u32 *)con_buf0;
+
+			for (p /= 4; this_round > 0; this_round -= 4)
+				*uni_buf++ = screen_uni(vc, 2 * p++, viewed);
+		} else if (!attr) {
 			org = screen_pos(vc, p, viewed);
 			col = p % maxcol;
 			p += maxcol - col;
@@ -281,20 +306,60 @@ unlock_out:
 	return ret;
 }
 
+/*
+ * Bulk helpers for vcs_write(): copy a run of cells that lies within a
+ * single screen row.  The cells are written straight into the screen
+ * buffer and only the cell under the soft cursor (if any) goes through
+ * vcs_scr_writew(), so the cursor bookkeeping stays the same as when
+ * every cell was written on its own.
+ */
+static void vcs_write_chars(struct vc_data *vc, u16 *org,
+			    const unsigned char *s, int n)
+{
+	u16 *cur = (u16 *)vc->vc_pos;
+	int i;
+
+	for (i = 0; i < n; i++)
+		scr_writew((scr_readw(org + i) & 0xff00) | s[i], org + i);
+	if (cur >= org && cur < org + n &&
+	    vc->display_fg->cursor_original != -1)
+		vcs_scr_writew(vc, (vcs_scr_readw(vc, cur) & 0xff00) |
+			       s[cur - org], cur);
+}
+
+static void vcs_write_words(struct vc_data *vc, u16 *org,
+			    const unsigned char *s, int n)
+{
+	u16 *cur = (u16 *)vc->vc_pos;
+	int i;
+
+	if (!((unsigned long)s & 1))
+		scr_memcpyw(org, (const u16 *)s, 2 * n);
+	else
+		for (i = 0; i < n; i++)
+			scr_writew(get_unaligned(((const u16 *)s) + i), org + i);
+	if (cur >= org && cur < org + n &&
+	    vc->display_fg->cursor_original != -1)
+		vcs_scr_writew(vc, scr_readw(cur), cur);
+}
+
 static ssize_t
 vcs_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
 {
 	struct inode *inode = file->f_dentry->d_inode;
 	struct vc_data *vc = file->private_data;
 	long viewed, size, written, pos;
-	long attr = iminor(inode) & 128;
-	u16 *org0 = NULL, *org = NULL;
+	long attr = iminor(inode) & VCS_ATTR;
+	long dirty_start = LONG_MAX, dirty_end = 0;
+	u16 *org = NULL;
 	size_t ret = -ENXIO;
 	int col, maxcol;
 	char *con_buf0;
 
 	if (!vc)
 		return ret;
+	if (iminor(inode) & VCS_UNI)
+		return -EINVAL;
 	down(&vc->display_fg->lock);
 
 	/* 
@@ -310,7 +375,7 @@ vcs_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
 		viewed = 0;
 	}
 
-	size = vcs_size(vc, attr);
+	size = vcs_size(vc, attr, 0);
 	ret = -EINVAL;
 	if (pos < 0 || pos > size)
 		goto unlock_out;
@@ -320,7 +385,7 @@ vcs_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
 	while (count) {
 		long this_round = count;
 		size_t orig_count;
-		long p;
+		long p, n, first, last;
 
 		if (this_round > BUF_SIZE)
 			this_round = BUF_SIZE;
@@ -350,7 +415,7 @@ vcs_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
 		 * the user buffer, so recheck.
 		 * Return data written up to now on failure.
 		 */
-		size = vcs_size(vc, attr);
+		size = vcs_size(vc, attr, 0);
 		if (pos >= size)
 			break;
 		if (this_round > size - pos)
@@ -358,6 +423,8 @@ vcs_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
 
 		/* OK, now actually push the write to the console
 		 * under the lock using the local kernel buffer.
+		 * Cells are copied a row at a time, the screen is
+		 * only redrawn once the whole write is done.
 		 */
 
 		con_buf0 = vc->display_fg->con_buf;
@@ -365,22 +432,17 @@ vcs_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
 		maxcol = vc->vc_cols;
 		p = pos;
 		if (!attr) {
-			org0 = org = screen_pos(vc, p, viewed);
+			first = p;
+			last = p + this_round;
 			col = p % maxcol;
-			p += maxcol - col;
-
 			while (this_round > 0) {
-				unsigned char c = *con_buf0++;
-
-				this_round--;
-				vcs_scr_writew(vc,
-					       (vcs_scr_readw(vc, org) & 0xff00) | c, org);
-				org++;
-				if (++col == maxcol) {
-					org = screen_pos(vc, p, viewed);
-					col = 0;
-					p += maxcol;
-				}
+				n = min_t(long, this_round, maxcol - col);
+				org = screen_pos(vc, p, viewed);
+				vcs_write_chars(vc, org, con_buf0, n);
+				con_buf0 += n;
+				this_round -= n;
+				p += n;
+				col = 0;
 			}
 		} else {
 			if (p < HEADER_SIZE) {
@@ -395,47 +457,40 @@ vcs_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
 					putconsxy(vc, header + 2);
 			}
 			p -= HEADER_SIZE;
-			col = (p/2) % maxcol;
+			first = last = 0;
 			if (this_round > 0) {
-				org0 = org = screen_pos(vc, p/2, viewed);
-				if ((p & 1) && this_round > 0) {
-					char c;
+				first = p / 2;
+				last = (p + this_round + 1) / 2;
+			}
+			if ((p & 1) && this_round > 0) {
+				char c;
 
-					this_round--;
-					c = *con_buf0++;
+				org = screen_pos(vc, p/2, viewed);
+				this_round--;
+				c = *con_buf0++;
 #ifdef __BIG_ENDIAN
-					vcs_scr_writew(vc, c |
-					     (vcs_scr_readw(vc, org) & 0xff00), org);
+				vcs_scr_writew(vc, c |
+				     (vcs_scr_readw(vc, org) & 0xff00), org);
 #else
-					vcs_scr_writew(vc, (c << 8) |
-					     (vcs_scr_readw(vc, org) & 0xff), org);
+				vcs_scr_writew(vc, (c << 8) |
+				     (vcs_scr_readw(vc, org) & 0xff), org);
 #endif
-					org++;
-					p++;
-					if (++col == maxcol) {
-						org = screen_pos(vc, p/2, viewed);
-						col = 0;
-					}
-				}
-				p /= 2;
-				p += maxcol - col;
+				p++;
 			}
+			col = (p/2) % maxcol;
 			while (this_round > 1) {
-				unsigned short w;
-
-				w = get_unaligned(((const unsigned short *)con_buf0));
-				vcs_scr_writew(vc, w, org++);
-				con_buf0 += 2;
-				this_round -= 2;
-				if (++col == maxcol) {
-					org = screen_pos(vc, p, viewed);
-					col = 0;
-					p += maxcol;
-				}
+				n = min_t(long, this_round / 2, maxcol - col);
+				org = screen_pos(vc, p/2, viewed);
+				vcs_write_words(vc, org, con_buf0, n);
+				con_buf0 += 2 * n;
+				this_round -= 2 * n;
+				p += 2 * n;
+				col = 0;
 			}
 			if (this_round > 0) {
 				unsigned char c;
 
+				org = screen_pos(vc, p/2, viewed);
 				c = *con_buf0++;
 #ifdef __BIG_ENDIAN
 				vcs_scr_writew(vc, (vcs_scr_readw(vc, org) & 0xff) | (c << 8), org);
@@ -444,16 +499,35 @@ vcs_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
 #endif
 			}
 		}
+		if (last > first) {
+			/* The Unicode value of what we wrote is unknown */
+			vc_uniscr_fill(vc, first, 0, last - first);
+			if (first < dirty_start)
+				dirty_start = first;
+			if (last > dirty_end)
+				dirty_end = last;
+		}
 		count -= orig_count;
 		written += orig_count;
 		buf += orig_count;
 		pos += orig_count;
-		if (org0)
-			update_region(vc, (unsigned long)(org0), org - org0);
 	}
 	*ppos += written;
 	ret = written;
 
+	/*
+	 * One redraw for everything written above.  Nothing needs to be
+	 * pushed to the display driver for a console that is not shown.
+	 */
+	if (viewed && IS_VISIBLE) {
+		size = vc->vc_rows * vc->vc_cols;
+		if (dirty_end > size)
+			dirty_end = size;
+		if (dirty_end > dirty_start)
+			update_region(vc, (unsigned long)screen_pos(vc, dirty_start, viewed),
+				      dirty_end - dirty_start);
+	}
+
 unlock_out:
 	release_console_sem();
 	up(&vc->display_fg->lock);
@@ -463,7 +537,7 @@ unlock_out:
 static int
 vcs_open(struct inode *inode, struct file *filp)
 {
-	unsigned int currcons = iminor(inode) & 127;
+	unsigned int currcons = iminor(inode) & (VCS_UNI - 1);
 	struct vc_data *vc = find_vc(currcons);
 
 	if (!vc)
@@ -489,15 +563,21 @@ void vcs_make_devfs(struct tty_struct *tty)
 	devfs_mk_cdev(MKDEV(VCS_MAJOR, tty->index + 129),
 			S_IFCHR|S_IRUSR|S_IWUSR,
 			"vcc/a%u", tty->index + 1);
+	devfs_mk_cdev(MKDEV(VCS_MAJOR, tty->index + 65),
+			S_IFCHR|S_IRUSR,
+			"vcc/u%u", tty->index + 1);
 	class_simple_device_add(vc_class, MKDEV(VCS_MAJOR, tty->index + 1), NULL, "vcs%u", tty->index + 1);
 	class_simple_device_add(vc_class, MKDEV(VCS_MAJOR, tty->index + 129), NULL, "vcsa%u", tty->index + 1);
+	class_simple_device_add(vc_class, MKDEV(VCS_MAJOR, tty->index + 65), NULL, "vcsu%u", tty->index + 1);
 }
 void vcs_remove_devfs(struct tty_struct *tty)
 {
 	devfs_remove("vcc/%u", tty->index + 1);
 	devfs_remove("vcc/a%u", tty->index + 1);
+	devfs_remove("vcc/u%u", tty->index + 1);
 	class_simple_device_remove(MKDEV(VCS_MAJOR, tty->index + 1));
 	class_simple_device_remove(MKDEV(VCS_MAJOR, tty->index + 129));
+	class_simple_device_remove(MKDEV(VCS_MAJOR, tty->index + 65));
 }
 
 int __init vcs_init(void)
@@ -508,7 +588,9 @@ int __init vcs_init(void)
 
 	devfs_mk_cdev(MKDEV(VCS_MAJOR, 0), S_IFCHR|S_IRUSR|S_IWUSR, "vcc/0");
 	devfs_mk_cdev(MKDEV(VCS_MAJOR, 128), S_IFCHR|S_IRUSR|S_IWUSR, "vcc/a0");
+	devfs_mk_cdev(MKDEV(VCS_MAJOR, 64), S_IFCHR|S_IRUSR, "vcc/u0");
 	class_simple_device_add(vc_class, MKDEV(VCS_MAJOR, 0), NULL, "vcs");
 	class_simple_device_add(vc_class, MKDEV(VCS_MAJOR, 128), NULL, "vcsa");
+	class_simple_device_add(vc_class, MKDEV(VCS_MAJOR, 64), NULL, "vcsu");
 	return 0;
 }
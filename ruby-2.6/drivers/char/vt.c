@@ -282,6 +282,142 @@ inline void gotoxay(struct vc_data *vc, int new_x, int new_y)
 	gotoxy(vc, new_x, vc->vc_decom ? (vc->vc_top+new_y) : new_y);
 }
 
+/*
+ *	Unicode shadow screen
+ *
+ * A VC can optionally keep the Unicode value of every character cell
+ * next to the glyph buffer, so that /dev/vcsu and the selection code
+ * do not have to guess it back from the font position.  A zero entry
+ * means the value is unknown (e.g. the cell was written through
+ * /dev/vcs) and the glyph has to be inverse translated instead.
+ */
+int vc_uniscr_alloc(struct vc_data *vc)
+{
+	unsigned int size = vc->vc_rows * vc->vc_cols * sizeof(u32);
+	u32 *uni;
+
+	WARN_CONSOLE_UNLOCKED();
+
+	if (vc->vc_uni_screen)
+		return 0;
+	uni = kmalloc(size, GFP_KERNEL);
+	if (!uni)
+		return -ENOMEM;
+	memset(uni, 0, size);
+	vc->vc_uni_screen = uni;
+	return 0;
+}
+
+void vc_uniscr_free(struct vc_data *vc)
+{
+	WARN_CONSOLE_UNLOCKED();
+
+	if (vc->vc_uni_screen) {
+		kfree(vc->vc_uni_screen);
+		vc->vc_uni_screen = NULL;
+	}
+}
+
+void vc_uniscr_fill(struct vc_data *vc, unsigned int offset, u32 ch, int count)
+{
+	u32 *p = vc->vc_uni_screen;
+
+	if (!p)
+		return;
+	for (p += offset; count > 0; count--)
+		*p++ = ch;
+}
+
+static inline void vc_uniscr_putc(struct vc_data *vc, u32 ch)
+{
+	if (vc->vc_uni_screen)
+		vc->vc_uni_screen[(vc->vc_pos - vc->vc_origin) >> 1] = ch;
+}
+
+static void vc_uniscr_scroll(struct vc_data *vc, unsigned int t, unsigned int b,
+			     int dir, unsigned int nr)
+{
+	u32 *top = vc->vc_uni_screen;
+	unsigned int cols = vc->vc_cols;
+
+	if (!top)
+		return;
+	top += t * cols;
+	if (dir == SM_UP) {
+		memmove(top, top + nr * cols, (b - t - nr) * cols * sizeof(u32));
+		vc_uniscr_fill(vc, (b - nr) * cols, ' ', nr * cols);
+	} else {
+		memmove(top + nr * cols, top, (b - t - nr) * cols * sizeof(u32));
+		vc_uniscr_fill(vc, t * cols, ' ', nr * cols);
+	}
+}
+
+static void vc_uniscr_insert(struct vc_data *vc, unsigned int nr)
+{
+	u32 *p = vc->vc_uni_screen;
+
+	if (!p)
+		return;
+	p += vc->vc_y * vc->vc_cols + vc->vc_x;
+	memmove(p + nr, p, (vc->vc_cols - vc->vc_x - nr) * sizeof(u32));
+	vc_uniscr_fill(vc, p - vc->vc_uni_screen, ' ', nr);
+}
+
+static void vc_uniscr_delete(struct vc_data *vc, unsigned int nr)
+{
+	u32 *p = vc->vc_uni_screen;
+
+	if (!p)
+		return;
+	p += vc->vc_y * vc->vc_cols + vc->vc_x;
+	memmove(p, p + nr, (vc->vc_cols - vc->vc_x - nr) * sizeof(u32));
+	vc_uniscr_fill(vc, (p - vc->vc_uni_screen) + vc->vc_cols - vc->vc_x - nr,
+		       ' ', nr);
+}
+
+/* Keep the shadow in step with the row copy done by vc_resize() */
+static void vc_uniscr_resize(struct vc_data *vc, unsigned int old_cols,
+			     unsigned int old_rows)
+{
+	u32 *old = vc->vc_uni_screen, *new, *p;
+	unsigned int cols = min(old_cols, vc->vc_cols);
+	unsigned int row, first = 0;
+
+	if (!old)
+		return;
+	vc->vc_uni_screen = NULL;
+	if (vc_uniscr_alloc(vc)) {
+		kfree(old);
+		return;
+	}
+	new = vc->vc_uni_screen;
+	if (vc->vc_rows < old_rows)
+		first = old_rows - vc->vc_rows;
+	for (row = first, p = new; row < old_rows; row++, p += vc->vc_cols)
+		memcpy(p, old + row * old_cols, cols * sizeof(u32));
+	kfree(old);
+}
+
+/*
+ * Unicode value of the character at byte @offset of the screen, with the
+ * same meaning of @viewed as for screenpos().  The shadow screen does not
+ * cover scrollback, so a scrolled back view always uses the glyphs.
+ */
+u32 screen_uni(struct vc_data *vc, int offset, int viewed)
+{
+	u32 *uni = vc->vc_uni_screen;
+	u16 w, c;
+
+	if (uni && (!viewed || vc->vc_visible_origin == vc->vc_origin) &&
+	    uni[offset >> 1])
+		return uni[offset >> 1];
+	w = scr_readw(screenpos(vc, offset, viewed));
+	c = w & 0xff;
+	if (w & vc->vc_hi_font_mask)
+		c |= 0x100;
+	return inverse_translate(vc, c);
+}
+
 /*
  *	Palettes
  */
@@ -335,6 +471,7 @@ void scroll_region_up(struct vc_data *vc, unsigned int t, unsigned int b, int nr
 		nr = b - t - 1;
 	if (b > vc->vc_rows || t >= b || nr < 1)
 		return;
+	vc_uniscr_scroll(vc, t, b, SM_UP, nr);
 	if (IS_VISIBLE && sw->con_scroll_region(vc, t, b, SM_UP, nr))
 		return;
 	d = (unsigned short *) (vc->vc_origin + vc->vc_size_row*t);
@@ -352,6 +489,7 @@ void scroll_region_down(struct vc_data *vc, unsigned int t, unsigned int b, int
 		nr = b - t - 1;
 	if (b > vc->vc_rows || t >= b || nr < 1)
 		return;
+	vc_uniscr_scroll(vc, t, b, SM_DOWN, nr);
 	if (IS_VISIBLE && sw->con_scroll_region(vc, t, b, SM_DOWN, nr))
 		return;
 	s = (unsigned short *) (vc->vc_origin + vc->vc_size_row*t);
@@ -443,6 +581,7 @@ void insert_char(struct vc_data *vc, unsigned int nr)
 	while (--p >= q)
 		scr_writew(scr_readw(p), p + nr);
 	scr_memsetw(q, vc->vc_video_erase_char, nr*2);
+	vc_uniscr_insert(vc, nr);
 	vc->vc_need_wrap = 0;
 	if (DO_UPDATE) {
 		unsigned short oldattr = vc->vc_attr;
@@ -466,6 +605,7 @@ void delete_char(struct vc_data *vc, unsigned int nr)
 		p++;
 	}
 	scr_memsetw(p, vc->vc_video_erase_char, nr*2);
+	vc_uniscr_delete(vc, nr);
 	vc->vc_need_wrap = 0;
 	if (DO_UPDATE) {
 		unsigned short oldattr = vc->vc_attr;
@@ -908,6 +1048,63 @@ static void vt_callback(void *private)
 	release_console_sem();
 }
 
+/*
+ * Bells.  A bell rung while the last one of the VC still sounds is
+ * merged into it, and a VC rings at most BELL_RATE_MAX bells a second,
+ * so that binary output full of BELs does not keep the beeper and its
+ * timer busy.  The visual bell flips the screen mode from a work
+ * queue, and back once the bell duration is over.
+ */
+#define BELL_RATE_MAX	4
+
+static void vt_bell_flash(void *private)
+{
+	struct vt_struct *vt = (struct vt_struct *) private;
+	struct vc_data *vc;
+
+	acquire_console_sem();
+	/* vt_bell_vc is only set while its screen is inverted */
+	vc = (vt->vt_bell_flash == 1) ? vt->fg_console : vt->vt_bell_vc;
+	if (vc && vc->vc_mode == KD_TEXT) {
+		vc->vc_decscnm ^= 1;
+		invert_screen(vc, 0, vc->vc_screenbuf_size, 0);
+		update_attr(vc);
+	} else
+		vc = NULL;
+	if (vt->vt_bell_flash == 1 && vc) {
+		vt->vt_bell_vc = vc;
+		vt->vt_bell_flash = 2;
+		schedule_delayed_work(&vt->vt_bell_work, vc->vc_bell_duration);
+	} else {
+		vt->vt_bell_vc = NULL;
+		vt->vt_bell_flash = 0;
+	}
+	release_console_sem();
+}
+
+void vc_bell(struct vc_data *vc)
+{
+	struct vt_struct *vt = vc->display_fg;
+
+	if (!vc->vc_bell_duration || time_before(jiffies, vc->vc_bell_end))
+		return;
+	if (time_after(jiffies, vc->vc_bell_window + HZ)) {
+		vc->vc_bell_window = jiffies;
+		vc->vc_bell_count = 0;
+	}
+	if (vc->vc_bell_count >= BELL_RATE_MAX)
+		return;
+	vc->vc_bell_count++;
+	vc->vc_bell_end = jiffies + vc->vc_bell_duration;
+
+	if (vt->vt_bell_mode != VT_BELL_VISUAL)
+		kd_mksound(vt->beeper, vc->vc_bell_pitch, vc->vc_bell_duration);
+	if (vt->vt_bell_mode != VT_BELL_AUDIBLE && IS_VISIBLE && !vt->vt_bell_flash) {
+		vt->vt_bell_flash = 1;
+		schedule_work(&vt->vt_bell_work);
+	}
+}
+
 inline void set_console(struct vc_data *vc)
 {
 	vc->display_fg->want_vc = vc;
@@ -943,7 +1140,9 @@ static void vc_init(struct vc_data *vc, int do_clear)
 	vc->vc_def_color = 0x07;	/* white */
 	vc->vc_ulcolor = 0x0f;		/* bold white */
 	vc->vc_halfcolor = 0x08;	/* grey */
-	init_waitqueue_head(&vc->paste_wait);
+	INIT_LIST_HEAD(&vc->paste_node);
+	/* jiffies start out well before 0, see INITIAL_JIFFIES */
+	vc->vc_bell_end = vc->vc_bell_window = jiffies;
 	vte_ris(vc, do_clear);
 }
 
@@ -1023,6 +1222,8 @@ found_pool:
 		}
 	}
 	vt->vc_cons[currcons - vt->first_vc] = vc;
+	if (vt->vt_uni_screen)
+		vc_uniscr_alloc(vc);	/* falls back to the glyphs on failure */
 	if ((vt->first_vc) == currcons)
 		vt->want_vc = vt->fg_console = vt->last_console = vc;
 	vc_init(vc, 1);
@@ -1038,6 +1239,10 @@ int vc_disallocate(struct vc_data *vc)
 	if (vc && vc->vc_num > MIN_NR_CONSOLES) {
 		sw->con_deinit(vc);
 		vt->vc_cons[vc->vc_num - vt->first_vc] = NULL;
+		paste_cancel(vc);
+		vc_uniscr_free(vc);
+		if (vt->vt_bell_vc == vc)
+			vt->vt_bell_vc = NULL;
 		if (vt->kmalloced)
 			kfree(screenbuf);
 		kfree(vc);
@@ -1137,6 +1342,7 @@ int vc_resize(struct vc_data *vc, unsigned int cols, unsigned int lines)
 	vc->vc_screenbuf = newscreen;
 	vc->display_fg->kmalloced = 1;
 	vc->vc_screenbuf_size = ss;
+	vc_uniscr_resize(vc, old_cols, old_rows);
 	set_origin(vc);
 
 	/* do part of a reset_terminal() */
@@ -1207,6 +1413,7 @@ static int do_con_write(struct tty_struct *tty, const unsigned char *buf, int co
 	const unsigned char *orig_buf = NULL;
 	int c, tc, ok, n = 0, draw_x = -1;
 	u16 himask, charmask;
+	u32 uc;
 	int orig_count;
 
 	if (in_interrupt())
@@ -1306,6 +1513,13 @@ static int do_con_write(struct tty_struct *tty, const unsigned char *buf, int co
 			&& (c != 128+27);
 
 		if (!vc->vc_state && ok) {
+			/* Remember the character itself for the shadow screen;
+			   direct-to-font codes carry no Unicode meaning. */
+			if ((tc & ~UNI_DIRECT_MASK) == UNI_DIRECT_BASE)
+				uc = 0;
+			else
+				uc = tc > 0x10ffff ? 0xfffd : tc;
+
 			/* Now try to find out how to display it */
 			tc = conv_uni_to_pc(vc, tc);
 			if ( tc == -4 ) {
@@ -1333,6 +1547,7 @@ static int do_con_write(struct tty_struct *tty, const unsigned char *buf, int co
 			}
 			if (vc->vc_irm)
 				insert_char(vc, 1);
+			vc_uniscr_putc(vc, uc);
 			scr_writew(himask ?
 				     ((vc->vc_attr << 8) & ~himask) + ((tc & 0x100) ? himask : 0) + (tc & 0xff) : (vc->vc_attr << 8) + tc, (u16 *) vc->vc_pos);
 			if (DO_UPDATE && draw_x < 0) {
@@ -1404,6 +1619,8 @@ static void vt_close(struct tty_struct *tty, struct file * filp)
 			vc->vc_tty = NULL;
 		tty->driver_data = NULL;
 		release_console_sem();
+		if (vc)
+			paste_cancel(vc);
 		vcs_remove_devfs(tty);
 		up(&tty_sem);
 		/*
@@ -1506,7 +1723,7 @@ static void vt_unthrottle(struct tty_struct *tty)
 {
 	struct vc_data *vc = tty->driver_data;
 
-	wake_up_interruptible(&vc->paste_wait);
+	paste_unthrottle(vc);
 }
 
 #ifdef CONFIG_VT_CONSOLE
@@ -1572,6 +1789,7 @@ void vt_console_print(struct console *co, const char *b, unsigned count)
 			if (c == 10 || c == 13)
 				continue;
 		}
+		vc_uniscr_putc(vc, 0);	/* raw font position, see screen_uni() */
 		scr_writew((vc->vc_attr << 8) + c, (unsigned short *) vc->vc_pos);
 		cnt++;
 		if (myx == vc->vc_cols - 1) {
@@ -1747,6 +1965,7 @@ const char *vt_map_display(struct vt_struct *vt, int init, int vc_count)
 	mod_timer(&vt->timer, jiffies + vt->blank_interval);
 	vt->keyboard = NULL;
 	INIT_WORK(&vt->vt_work, vt_callback, vt);
+	INIT_WORK(&vt->vt_bell_work, vt_bell_flash, vt);
 
 	if (!admin_vt) {
 		admin_vt = vt;
@@ -1873,6 +2092,7 @@ int take_over_console(struct vt_struct *vt, const struct consw *csw)
 	/* First shutdown old console driver */
 	acquire_console_sem();
 	hide_cursor(vc);
+	con_font_forget(vt);
 
 	for (i = 0; i < vt->vc_count; i++) {
 		vc = vt->vc_cons[i];
@@ -20,19 +20,23 @@
 #include <linux/vt.h>
 #include <linux/string.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <linux/major.h>
 #include <linux/fs.h>
 #include <linux/console.h>
 #include <linux/signal.h>
 #include <linux/timex.h>
+#include <linux/rcupdate.h>
 
 #include <asm/io.h>
 #include <asm/uaccess.h>
 
 #include <linux/vt_kern.h>
 #include <linux/kbd_diacr.h>
+#include <linux/kbd_image.h>
 #include <linux/selection.h>
 #include <linux/font.h>
+#include <linux/input_frame.h>
 
 #define VT_IS_IN_USE(vc)(vc->vc_tty && vc->vc_tty->count)
 #define VT_BUSY(vc)	(VT_IS_IN_USE(vc) || IS_VISIBLE || vc == sel_cons)
@@ -172,8 +176,6 @@ do_kdsk_ioctl(struct vc_data *vc, int cmd, struct kbentry __user *user_kbe, int
 		if (((ov == K_SAK) || (v == K_SAK)) && !capable(CAP_SYS_ADMIN))
 			return -EPERM;
 		key_map[i] = U(v);
-		if (!s && (KTYP(ov) == KT_SHIFT || KTYP(v) == KT_SHIFT))
-			compute_shiftstate();
 		break;
 	}
 	return 0;
@@ -205,14 +207,204 @@ do_kbkeycode_ioctl(struct vc_data *vc, int cmd, struct kbkeycode __user *user_kb
 	return kc;
 }
 
+/*
+ * Function key strings set at run time live in an arena of chunks.  A
+ * new string is appended to the newest chunk and the old one is just
+ * forgotten, so setting a string never moves the others.  Once most of
+ * the arena is dead, the live strings are packed into a new chunk.
+ */
+struct func_chunk {
+	struct func_chunk *next;
+	int size, used;
+	char data[0];
+};
+
+#define FUNC_CHUNK_SIZE	1024
+
+static struct func_chunk *func_arena;
+static int func_arena_used;	/* bytes used in all chunks */
+static int func_live = -1;	/* bytes of all strings in func_table */
+
+/* Make room for len bytes of strings in the newest chunk */
+static int func_reserve(int len)
+{
+	struct func_chunk *c = func_arena;
+	int i, sz = FUNC_CHUNK_SIZE;
+
+	if (func_live < 0)
+		for (i = func_live = 0; i < MAX_NR_FUNC; i++)
+			if (func_table[i])
+				func_live += strlen(func_table[i]) + 1;
+	if (c && c->size - c->used >= len)
+		return 0;
+	while (sz < len)
+		sz <<= 1;
+	c = kmalloc(sizeof(*c) + sz, GFP_KERNEL);
+	if (!c)
+		return -ENOMEM;
+	c->size = sz;
+	c->used = 0;
+	c->next = func_arena;
+	func_arena = c;
+	return 0;
+}
+
+/* Copy a string with its NUL into space made by func_reserve() */
+static char *func_copy(const char *str, int len)
+{
+	char *p = func_arena->data + func_arena->used;
+
+	memcpy(p, str, len);
+	func_arena->used += len;
+	func_arena_used += len;
+	return p;
+}
+
+static void func_publish(int i, char *p)
+{
+	if (func_table[i])
+		func_live -= strlen(func_table[i]) + 1;
+	if (p)
+		func_live += strlen(p) + 1;
+	func_table[i] = p;
+}
+
+static void func_compact(void)
+{
+	struct func_chunk *c, *old;
+	unsigned long flags;
+	char *p;
+	int i, len;
+
+	if (func_arena_used <= FUNC_CHUNK_SIZE || func_arena_used <= 2 * func_live)
+		return;
+	c = kmalloc(sizeof(*c) + func_live, GFP_KERNEL);
+	if (!c)
+		return;		/* try again next time */
+	c->size = c->used = func_live;
+	c->next = NULL;
+	for (i = 0, p = c->data; i < MAX_NR_FUNC; i++) {
+		if (!func_table[i])
+			continue;
+		len = strlen(func_table[i]) + 1;
+		memcpy(p, func_table[i], len);
+		p += len;
+	}
+
+	smp_wmb();
+	local_irq_save(flags);
+	for (i = 0, p = c->data; i < MAX_NR_FUNC; i++) {
+		if (!func_table[i])
+			continue;
+		func_table[i] = p;
+		p += strlen(p) + 1;
+	}
+	old = func_arena;
+	func_arena = c;
+	func_arena_used = func_live;
+	local_irq_restore(flags);
+	/* kbd_event() on another CPU may still be reading an old string */
+	synchronize_kernel();
+
+	while (old) {
+		c = old->next;
+		kfree(old);
+		old = c;
+	}
+}
+
+/*
+ * Parses count packed function key strings, each an index byte followed
+ * by the NUL terminated string, into strs[].  Returns the bytes used or
+ * -EINVAL; *total gets the room the strings need.
+ */
+static int func_parse(unsigned char *p, unsigned char *end, int count,
+		      char **strs, int *total)
+{
+	unsigned char *start = p;
+	int i, len;
+
+	*total = 0;
+	while (count--) {
+		if (p >= end || strs[*p])	/* an index byte is < MAX_NR_FUNC */
+			return -EINVAL;
+		i = *p++;
+		len = strnlen((char *) p, end - p);
+		if (p + len == end)
+			return -EINVAL;
+		strs[i] = (char *) p;
+		p += len + 1;
+		*total += len + 1;
+	}
+	return p - start;
+}
+
+/*
+ * Sets the strings given in strs[] at once.
+ */
+static int func_replace(char **strs, int total)
+{
+	unsigned long flags;
+	int i;
+
+	if (func_reserve(total))
+		return -ENOMEM;
+	for (i = 0; i < MAX_NR_FUNC; i++)
+		if (strs[i])
+			strs[i] = func_copy(strs[i], strlen(strs[i]) + 1);
+
+	smp_wmb();
+	local_irq_save(flags);
+	for (i = 0; i < MAX_NR_FUNC; i++)
+		if (strs[i])
+			func_publish(i, strs[i]);
+	local_irq_restore(flags);
+	func_compact();
+	return 0;
+}
+
+static int do_kdskbsents_ioctl(struct kbsentries __user *up, int perm)
+{
+	struct kbsentries hdr;
+	unsigned char *buf;
+	char **strs;
+	int total, ret;
+
+	if (!perm)
+		return -EPERM;
+	if (copy_from_user(&hdr, up, sizeof(hdr)))
+		return -EFAULT;
+	if (hdr.size < sizeof(hdr) || hdr.size > KBIMAGE_MAX_SIZE ||
+	    hdr.count > MAX_NR_FUNC)
+		return -EINVAL;
+	buf = vmalloc(hdr.size);
+	if (!buf)
+		return -ENOMEM;
+	strs = kmalloc(MAX_NR_FUNC * sizeof(char *), GFP_KERNEL);
+	if (!strs) {
+		vfree(buf);
+		return -ENOMEM;
+	}
+	memset(strs, 0, MAX_NR_FUNC * sizeof(char *));
+	ret = -EFAULT;
+	if (copy_from_user(buf, up, hdr.size))
+		goto out;
+	ret = func_parse(buf + sizeof(hdr), buf + hdr.size, hdr.count, strs, &total);
+	if (ret >= 0)
+		ret = func_replace(strs, total);
+out:
+	kfree(strs);
+	vfree(buf);
+	return ret;
+}
+
 static inline int
 do_kdgkb_ioctl(int cmd, struct kbsentry __user *user_kdgkb, int perm)
 {
-	char *first_free, *fj, *fnw, *p;
-	int i, j, k, delta, sz, ret;
+	int i, sz, ret;
 	struct kbsentry *kbs;
 	u_char __user *up;
-	u_char *q;
+	char *p;
 
 	kbs = kmalloc(sizeof(*kbs), GFP_KERNEL);
 	if (!kbs) {
@@ -251,56 +443,13 @@ do_kdgkb_ioctl(int cmd, struct kbsentry __user *user_kdgkb, int perm)
 			ret = -EPERM;
 			goto reterr;
 		}
-		q = func_table[i];
-		first_free = funcbufptr + (funcbufsize - funcbufleft);
-		for (j = i + 1; j < MAX_NR_FUNC && !func_table[j]; j++); 
-		
-		if (j < MAX_NR_FUNC)
-			fj = func_table[j];
-		else
-			fj = first_free;
-
-		delta = (q ? -strlen(q) : 1) + strlen(kbs->kb_string);
-		if (delta <= funcbufleft) { 	/* it fits in current buf */
-			if (j < MAX_NR_FUNC) {
-				memmove(fj + delta, fj, first_free - fj);
-				for (k = j; k < MAX_NR_FUNC; k++)
-					if (func_table[k])
-						func_table[k] += delta;
-			}
-			if (!q)
-				func_table[i] = fj;
-			funcbufleft -= delta;
-		} else {	/* allocate a larger buffer */
-			sz = 256;
-			while (sz < funcbufsize - funcbufleft + delta)
-				sz <<= 1;
-			fnw = (char *) kmalloc(sz, GFP_KERNEL);
-			if (!fnw) {
-				ret = -ENOMEM;
-				goto reterr;
-			}	
-			if (!q)
-				func_table[i] = fj;
-			if (fj > funcbufptr)
-				memmove(fnw, funcbufptr, fj - funcbufptr);
-			for (k = 0; k < j; k++)
-				if (func_table[k])
-					func_table[k] = fnw + (func_table[k] - funcbufptr);
-
-			if (first_free > fj) {
-				memmove(fnw + (fj - funcbufptr) + delta, fj, first_free - fj);
-				for (k = j; k < MAX_NR_FUNC; k++)
-					if (func_table[k])
-						func_table[k] = fnw + (func_table[k] - funcbufptr) + delta;
-			}
-			if (funcbufptr != func_buf)
-				kfree(funcbufptr);
-			funcbufptr = fnw;
-			funcbufleft = funcbufleft - delta + sz - funcbufsize;
-			funcbufsize = sz;
+		sz = strlen(kbs->kb_string) + 1;
+		if (func_reserve(sz)) {
+			ret = -ENOMEM;
+			goto reterr;
 		}
-		strcpy(func_table[i], kbs->kb_string);
+		func_publish(i, func_copy(kbs->kb_string, sz));
+		func_compact();
 		break;
 	}
 	ret = 0;
@@ -309,6 +458,239 @@ reterr:
 	return ret;
 }
 
+/*
+ * Keymap images, see <linux/kbd_image.h>.  A new image is checked and
+ * built completely before the key maps, function key strings and
+ * diacritics are replaced in one go, so the keyboard never sees half
+ * of a keymap.
+ */
+#define KBIMAGE_MAP_SIZE	(sizeof(struct kbimage_map) + NR_KEYS * sizeof(u16))
+
+struct kbimage_tables {
+	ushort *maps[MAX_NR_KEYMAPS];
+	char *funcs[MAX_NR_FUNC];
+};
+
+/*
+ * Writes as much of the current keymap image as fits in size bytes
+ * and returns the size of the whole image.
+ */
+static int kbimage_fill(struct vc_data *vc, unsigned char *image, int size)
+{
+	struct kbimage_header *hdr = (struct kbimage_header *) image;
+	struct kbimage_map *m;
+	int i, j, len, pos = sizeof(*hdr);
+	int nr_maps = 0, nr_funcs = 0, nr_diacrs;
+	ushort val;
+
+	for (i = 0; i < MAX_NR_KEYMAPS; i++) {
+		if (!key_maps[i])
+			continue;
+		if (pos + KBIMAGE_MAP_SIZE <= size) {
+			m = (struct kbimage_map *) (image + pos);
+			m->table = i;
+			m->reserved = 0;
+			for (j = 0; j < NR_KEYS; j++) {
+				val = U(key_maps[i][j]);
+				if (vc->kbd_table.kbdmode != VC_UNICODE && KTYP(val) >= NR_TYPES)
+					val = K_HOLE;
+				m->map[j] = val;
+			}
+		}
+		pos += KBIMAGE_MAP_SIZE;
+		nr_maps++;
+	}
+
+	nr_diacrs = kbd_diacr_dump((struct kbdiacr *) (image + pos),
+				   size > pos ? (size - pos) / sizeof(struct kbdiacr) : 0);
+	pos += nr_diacrs * sizeof(struct kbdiacr);
+
+	for (i = 0; i < MAX_NR_FUNC; i++) {
+		if (!func_table[i])
+			continue;
+		len = strlen(func_table[i]) + 1;
+		if (pos + 1 + len <= size) {
+			image[pos] = i;
+			memcpy(image + pos + 1, func_table[i], len);
+		}
+		pos += 1 + len;
+		nr_funcs++;
+	}
+
+	if (size >= sizeof(*hdr)) {
+		hdr->magic = KBIMAGE_MAGIC;
+		hdr->version = KBIMAGE_VERSION;
+		hdr->keys = NR_KEYS;
+		hdr->size = pos;
+		hdr->nr_maps = nr_maps;
+		hdr->nr_diacrs = nr_diacrs;
+		hdr->nr_funcs = nr_funcs;
+		hdr->reserved = 0;
+	}
+	return pos;
+}
+
+static int kbimage_get(struct vc_data *vc, struct kbimage_header __user *up)
+{
+	struct kbimage_header hdr;
+	unsigned char *image;
+	int size, ret = 0;
+
+	if (get_user(size, &up->size))
+		return -EFAULT;
+	if (kbimage_fill(vc, (unsigned char *) &hdr, sizeof(hdr)) > size) {
+		/* tell the caller how much room it needs */
+		if (copy_to_user(up, &hdr, sizeof(hdr)))
+			return -EFAULT;
+		return -ENOSPC;
+	}
+	size = hdr.size;
+	image = vmalloc(size);
+	if (!image)
+		return -ENOMEM;
+	if (kbimage_fill(vc, image, size) != size)
+		ret = -EAGAIN;		/* changed meanwhile */
+	else if (copy_to_user(up, image, size))
+		ret = -EFAULT;
+	vfree(image);
+	return ret;
+}
+
+static int kbimage_check_map(struct vc_data *vc, int table, u16 *map)
+{
+	ushort v, ov;
+	int i;
+
+	for (i = 0; i < NR_KEYS; i++) {
+		v = map[i];
+#if !defined(__mc68000__) && !defined(__powerpc__)
+		/* entry 0 is the allocation marker */
+		if (!i)
+			continue;
+#endif
+		if (KTYP(v) < NR_TYPES) {
+			if (KVAL(v) > max_vals[KTYP(v)])
+				return -EINVAL;
+		} else if (vc->kbd_table.kbdmode != VC_UNICODE)
+			return -EINVAL;
+		/* Attention Key */
+		ov = key_maps[table] ? U(key_maps[table][i]) : K_HOLE;
+		if (v != ov && (ov == K_SAK || v == K_SAK) &&
+		    !capable(CAP_SYS_ADMIN))
+			return -EPERM;
+	}
+	return 0;
+}
+
+static int kbimage_set(struct vc_data *vc, struct kbimage_header __user *up, int perm)
+{
+	struct kbimage_header hdr;
+	struct kbimage_tables *new;
+	struct kbimage_map *m;
+	struct kbdiacr *diacrs;
+	struct kbd_diacr_index *dindex = NULL;
+	unsigned char *image, *p, *end;
+	unsigned long flags;
+	int i, j, len, total, ret;
+
+	if (!perm)
+		return -EPERM;
+	if (copy_from_user(&hdr, up, sizeof(hdr)))
+		return -EFAULT;
+	if (hdr.magic != KBIMAGE_MAGIC || hdr.version != KBIMAGE_VERSION ||
+	    hdr.keys != NR_KEYS || hdr.size < sizeof(hdr) ||
+	    hdr.size > KBIMAGE_MAX_SIZE || hdr.nr_maps > MAX_NR_KEYMAPS ||
+	    hdr.nr_funcs > MAX_NR_FUNC)
+		return -EINVAL;
+	if (hdr.nr_maps > MAX_NR_OF_USER_KEYMAPS && !capable(CAP_SYS_RESOURCE))
+		return -EPERM;
+
+	image = vmalloc(hdr.size);
+	if (!image)
+		return -ENOMEM;
+	new = kmalloc(sizeof(*new), GFP_KERNEL);
+	if (!new) {
+		vfree(image);
+		return -ENOMEM;
+	}
+	memset(new, 0, sizeof(*new));
+	ret = -EFAULT;
+	if (copy_from_user(image, up, hdr.size))
+		goto out;
+
+	ret = -EINVAL;
+	p = image + sizeof(hdr);
+	end = image + hdr.size;
+	if (end - p < hdr.nr_maps * KBIMAGE_MAP_SIZE +
+		      hdr.nr_diacrs * sizeof(struct kbdiacr))
+		goto out;
+	for (i = 0; i < hdr.nr_maps; i++, p += KBIMAGE_MAP_SIZE) {
+		m = (struct kbimage_map *) p;
+		if (m->table >= MAX_NR_KEYMAPS || new->maps[m->table]) {
+			ret = -EINVAL;
+			goto out;
+		}
+		if ((ret = kbimage_check_map(vc, m->table, m->map)))
+			goto out;
+		ret = -ENOMEM;
+		new->maps[m->table] = kmalloc(sizeof(plain_map), GFP_KERNEL);
+		if (!new->maps[m->table])
+			goto out;
+		for (j = 0; j < NR_KEYS; j++)
+			new->maps[m->table][j] = U(m->map[j]);
+#if !defined(__mc68000__) && !defined(__powerpc__)
+		new->maps[m->table][0] = U(K_ALLOCATED);
+#endif
+	}
+	ret = -EINVAL;
+	if (!new->maps[0])
+		goto out;	/* the plain map can not go away */
+
+	diacrs = (struct kbdiacr *) p;
+	p += hdr.nr_diacrs * sizeof(struct kbdiacr);
+
+	if ((len = func_parse(p, end, hdr.nr_funcs, new->funcs, &total)) < 0 ||
+	    p + len != end)
+		goto out;
+
+	ret = -ENOMEM;
+	if (!(dindex = kbd_diacr_build(diacrs, hdr.nr_diacrs)))
+		goto out;
+	if (func_reserve(total))
+		goto out;
+	for (i = 0; i < MAX_NR_FUNC; i++)
+		if (new->funcs[i])
+			new->funcs[i] = func_copy(new->funcs[i], strlen(new->funcs[i]) + 1);
+
+	smp_wmb();
+	local_irq_save(flags);
+	for (i = 0; i < MAX_NR_KEYMAPS; i++) {
+		ushort *old = key_maps[i];
+
+		key_maps[i] = new->maps[i];
+		new->maps[i] = old;
+	}
+	keymap_count = hdr.nr_maps;
+	for (i = 0; i < MAX_NR_FUNC; i++)
+		func_publish(i, new->funcs[i]);
+	dindex = kbd_diacr_install(dindex);
+	local_irq_restore(flags);
+	/* kbd_event() on another CPU may still be in the old maps */
+	synchronize_kernel();
+
+	func_compact();
+	ret = 0;
+out:
+	/* the replaced maps on success, the unused new ones otherwise */
+	for (i = 0; i < MAX_NR_KEYMAPS; i++)
+		if (new->maps[i] && new->maps[i][0] == U(K_ALLOCATED))
+			kfree(new->maps[i]);
+	kbd_diacr_free(dindex);
+	kfree(new);
+	vfree(image);
+	return ret;
+}
+
 
 /*
  *  Font switching
@@ -325,6 +707,85 @@ reterr:
 
 #define max_font_size 65536
 
+/*
+ * Fonts loaded with KD_FONT_OP_SET are interned by content, so that
+ * setting the same font on every console shares one copy, and a
+ * display which already has it is not reprogrammed.  vt_font holds a
+ * reference to the font last loaded on each display.  Everything here
+ * is protected by the console semaphore.
+ */
+struct con_font {
+	struct hlist_node	node;
+	u32			hash;
+	unsigned int		refcount;
+	int			size;
+	struct console_font	font;	/* data follows */
+};
+
+#define FONT_HASH_SIZE	16
+
+static struct hlist_head font_hash[FONT_HASH_SIZE];
+
+static u32 con_font_hash(struct con_font *f)
+{
+	const unsigned char *p = f->font.data;
+	u32 h = 2166136261U;		/* FNV-1a */
+	int i;
+
+	h ^= f->font.width | (f->font.height << 8) | (f->font.charcount << 16);
+	for (i = 0; i < f->size; i++)
+		h = (h ^ p[i]) * 16777619;
+	return h;
+}
+
+/*
+ * Returns the cached font with the contents of f, which is freed, or f
+ * itself after adding it to the cache.
+ */
+static struct con_font *con_font_intern(struct con_font *f)
+{
+	struct hlist_head *head;
+	struct hlist_node *n;
+	struct con_font *old;
+
+	f->hash = con_font_hash(f);
+	head = &font_hash[f->hash % FONT_HASH_SIZE];
+	hlist_for_each_entry(old, n, head, node) {
+		if (old->hash == f->hash && old->size == f->size &&
+		    old->font.width == f->font.width &&
+		    old->font.height == f->font.height &&
+		    old->font.charcount == f->font.charcount &&
+		    !memcmp(old->font.data, f->font.data, f->size)) {
+			old->refcount++;
+			kfree(f);
+			return old;
+		}
+	}
+	f->refcount = 1;
+	hlist_add_head(&f->node, head);
+	return f;
+}
+
+static void con_font_put(struct con_font *f)
+{
+	if (f && !--f->refcount) {
+		hlist_del(&f->node);
+		kfree(f);
+	}
+}
+
+/*
+ * Called when the font on a display is no longer known, e.g. after
+ * a graphics mode application or a new console driver had it.
+ */
+void con_font_forget(struct vt_struct *vt)
+{
+	WARN_CONSOLE_UNLOCKED();
+
+	con_font_put(vt->vt_font);
+	vt->vt_font = NULL;
+}
+
 int con_font_get(struct vc_data *vc, struct console_font_op *op)
 {
 	struct console_font font;
@@ -380,7 +841,9 @@ out:
 
 int con_font_set(struct vc_data *vc, struct console_font_op *op)
 {
+	struct vt_struct *vt;
 	struct console_font font;
+	struct con_font *f;
 	int rc = -EINVAL;
 	int size;
 
@@ -415,23 +878,34 @@ nonzero:
 	size = (op->width+7)/8 * 32 * op->charcount;
 	if (size > max_font_size)
 		return -ENOSPC;
-	font.charcount = op->charcount;
-	font.height = op->height;
-	font.width = op->width;
-	font.data = kmalloc(size, GFP_KERNEL);
-	if (!font.data)
+	f = kmalloc(sizeof(*f) + size, GFP_KERNEL);
+	if (!f)
 		return -ENOMEM;
-	if (copy_from_user(font.data, op->data, size)) {
-		kfree(font.data);
+	f->size = size;
+	f->font.charcount = op->charcount;
+	f->font.height = op->height;
+	f->font.width = op->width;
+	f->font.data = (unsigned char *)(f + 1);
+	if (copy_from_user(f->font.data, op->data, size)) {
+		kfree(f);
 		return -EFAULT;
 	}
 	acquire_console_sem();
-	if (vc->display_fg->vt_sw->con_font_set)
-		rc = vc->display_fg->vt_sw->con_font_set(vc, &font, op->flags);
+	vt = vc->display_fg;
+	f = con_font_intern(f);
+	font = f->font;
+	if (vt->vt_sw->con_font_set)
+		rc = vt->vt_sw->con_font_set(vc, &font,
+				(op->flags & ~KD_FONT_FLAG_LOADED) |
+				(vt->vt_font == f ? KD_FONT_FLAG_LOADED : 0));
 	else
 		rc = -ENOSYS;
+	if (!rc) {
+		con_font_put(vt->vt_font);
+		vt->vt_font = f;
+	} else
+		con_font_put(f);
 	release_console_sem();
-	kfree(font.data);
 	return rc;
 }
 
@@ -457,6 +931,8 @@ int con_font_default(struct vc_data *vc, struct console_font_op *op)
 		rc = vc->display_fg->vt_sw->con_font_default(vc, &font, s);
 	else
 		rc = -ENOSYS;
+	if (!rc)
+		con_font_forget(vc->display_fg);
 	release_console_sem();
 	if (!rc) {
 		op->width = font.width;
@@ -480,8 +956,8 @@ int con_font_copy(struct vc_data *vc, struct console_font_op *op)
 		rc = -ENOTTY;
 	else if (con == vc->vc_num)	/* nothing to do */
 		rc = 0;
-	else
-		rc = vc->display_fg->vt_sw->con_font_copy(vc, con);
+	else if (!(rc = vc->display_fg->vt_sw->con_font_copy(vc, con)))
+		con_font_forget(vc->display_fg);
 	release_console_sem();
 	return rc;
 }
@@ -629,7 +1105,6 @@ inline void switch_screen(struct vc_data *new_vc, struct vc_data *old_vc)
         }
         set_cursor(new_vc);
         set_leds();
-        compute_shiftstate();
 }
 
 /*
@@ -704,6 +1179,7 @@ void complete_change_console(struct vc_data *new_vc, struct vc_data *old_vc)
 	unsigned char old_vc_mode;
 
 	new_vc->display_fg->last_console = old_vc;
+	paste_cancel(old_vc);
 
 	/*
 	 * If we're switching, we could be going from KD_GRAPHICS to
@@ -713,6 +1189,10 @@ void complete_change_console(struct vc_data *new_vc, struct vc_data *old_vc)
 	old_vc_mode = old_vc->vc_mode;
 	switch_screen(new_vc, old_vc);
 
+	if (new_vc->kbd_rep_delay || new_vc->kbd_rep_period ||
+	    old_vc->kbd_rep_delay || old_vc->kbd_rep_period)
+		kbd_vc_rate(new_vc);
+
 	/*
 	 * This can't appear below a successful kill_proc().  If it did,
 	 * then the *blank_screen operation could occur while X, having
@@ -865,9 +1345,22 @@ int vt_ioctl(struct tty_struct *tty, struct file * file,
 
 		if (copy_from_user(&kbrep, up, sizeof(struct kbd_repeat)))
 			return -EFAULT;
-		err = kbd_rate(vc->display_fg->keyboard, &kbrep);
-		if (err)
-			return err;
+		/* the rate belongs to this VC, the keyboard follows the foreground */
+		if (kbrep.delay > 0)
+			vc->kbd_rep_delay = kbrep.delay;
+		if (kbrep.period > 0)
+			vc->kbd_rep_period = kbrep.period;
+		if (IS_VISIBLE) {
+			err = kbd_rate(vc->display_fg->keyboard, &kbrep);
+			if (err)
+				return err;
+		} else {
+			/* what kbd_vc_rate() will set when it comes forward */
+			kbrep.delay = vc->kbd_rep_delay ?
+				vc->kbd_rep_delay : INPUT_REP_DELAY_DEFAULT;
+			kbrep.period = vc->kbd_rep_period ?
+				vc->kbd_rep_period : INPUT_REP_PERIOD_DEFAULT;
+		}
 		if (copy_to_user(up, &kbrep, sizeof(struct kbd_repeat)))
 			return -EFAULT;
 		return 0;
@@ -898,6 +1391,12 @@ int vt_ioctl(struct tty_struct *tty, struct file * file,
 		if (vc->vc_mode == (unsigned char) arg)
 			return 0;
 		vc->vc_mode = (unsigned char) arg;
+		if (arg == KD_GRAPHICS) {
+			/* the application may well reprogram the font */
+			acquire_console_sem();
+			con_font_forget(vc->display_fg);
+			release_console_sem();
+		}
 		if (!IS_VISIBLE)
 			return 0;
 		/*
@@ -935,11 +1434,9 @@ int vt_ioctl(struct tty_struct *tty, struct file * file,
 			break;
 		  case K_XLATE:
 			vc->kbd_table.kbdmode = VC_XLATE;
-			compute_shiftstate();
 			break;
 		  case K_UNICODE:
 			vc->kbd_table.kbdmode = VC_UNICODE;
-			compute_shiftstate();
 			break;
 		  default:
 			return -EINVAL;
@@ -988,20 +1485,39 @@ int vt_ioctl(struct tty_struct *tty, struct file * file,
 	case KDSKBSENT:
 		return do_kdgkb_ioctl(cmd, up, perm);
 
+	case KDSKBSENTS:
+		return do_kdskbsents_ioctl(up, perm);
+
+	case KDGKBIMAGE:
+		return kbimage_get(vc, up);
+
+	case KDSKBIMAGE:
+		return kbimage_set(vc, up, perm);
+
 	case KDGKBDIACR:
 	{
 		struct kbdiacrs __user *a = up;
+		struct kbdiacr *dia;
+		unsigned int ct;
 
-		if (put_user(accent_table_size, &a->kb_cnt))
-			return -EFAULT;
-		if (copy_to_user(a->kbdiacr, accent_table, accent_table_size*sizeof(struct kbdiacr)))
-			return -EFAULT;
-		return 0;
+		/* larger tables only fit in a keymap image */
+		dia = kmalloc(MAX_DIACR * sizeof(struct kbdiacr), GFP_KERNEL);
+		if (!dia)
+			return -ENOMEM;
+		ct = min(kbd_diacr_dump(dia, MAX_DIACR), (unsigned int) MAX_DIACR);
+		i = 0;
+		if (put_user(ct, &a->kb_cnt) ||
+		    copy_to_user(a->kbdiacr, dia, ct*sizeof(struct kbdiacr)))
+			i = -EFAULT;
+		kfree(dia);
+		return i;
 	}
 
 	case KDSKBDIACR:
 	{
 		struct kbdiacrs __user *a = up;
+		struct kbd_diacr_index *index;
+		struct kbdiacr *dia;
 		unsigned int ct;
 
 		if (!perm)
@@ -1010,9 +1526,20 @@ int vt_ioctl(struct tty_struct *tty, struct file * file,
 			return -EFAULT;
 		if (ct >= MAX_DIACR)
 			return -EINVAL;
-		accent_table_size = ct;
-		if (copy_from_user(accent_table, a->kbdiacr, ct*sizeof(struct kbdiacr)))
+		dia = kmalloc(MAX_DIACR * sizeof(struct kbdiacr), GFP_KERNEL);
+		if (!dia)
+			return -ENOMEM;
+		if (copy_from_user(dia, a->kbdiacr, ct*sizeof(struct kbdiacr))) {
+			kfree(dia);
 			return -EFAULT;
+		}
+		index = kbd_diacr_build(dia, ct);
+		kfree(dia);
+		if (!index)
+			return -ENOMEM;
+		index = kbd_diacr_install(index);
+		synchronize_kernel();
+		kbd_diacr_free(index);
 		return 0;
 	}
 
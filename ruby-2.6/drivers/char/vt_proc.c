@@ -11,9 +11,12 @@
 #ifdef CONFIG_PROC_FS
 #include <linux/types.h>
 #include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/string.h>
 #include <linux/proc_fs.h>
 #include <linux/init.h>
 #include <linux/vt_kern.h>
+#include <linux/console.h>
 #include <linux/input.h>
 #include <asm/uaccess.h>
 #include <linux/module.h>
@@ -71,27 +74,12 @@ read_kbd_phys(char *page, char **start, off_t off, int count, int *eof, void *da
         return generic_read(page, start, off, count, eof, len);
 }
 
-static int
-write_kbd_phys(struct file *file, const char *buffer,
-	       unsigned long count, void *data)
+static void
+bind_kbd_phys(struct vt_struct *vt, char *phys_descr)
 {
-        struct vt_struct *vt = (struct vt_struct*) data;
 	struct input_handle *handle;
-	char phys_descr[WRITE_BUF_MAX_LEN + 1];
 	int add_next = 0;
 
-        if (!vt || !buffer)
-                return -EINVAL;
-
-        if (count > WRITE_BUF_MAX_LEN) {
-                count = WRITE_BUF_MAX_LEN;
-        }
-        if (copy_from_user(phys_descr, buffer, count))
-                return -EFAULT;
-        
-	if(phys_descr[count-1] == 0x0A) phys_descr[count-1] = '\0';
-	else phys_descr[count] = '\0';
-
 	if(phys_descr[0] == 0x2B) //1st is "+" sign
 		add_next = 1;
 	handle = input_find_handle(phys_descr+add_next);
@@ -106,12 +94,227 @@ write_kbd_phys(struct file *file, const char *buffer,
 			handle->dev->name, vt->display_desc, vt->first_vc + 1,
 			vt->first_vc + vt->vc_count);
 	}
+}
+
+/*
+ * Takes one phys per line, so that a seat can be set up with a single
+ * write.  A line starting with "+" adds a keyboard instead of replacing
+ * the current one.
+ */
+static int
+write_kbd_phys(struct file *file, const char *buffer,
+	       unsigned long count, void *data)
+{
+        struct vt_struct *vt = (struct vt_struct*) data;
+	char phys_descr[WRITE_BUF_MAX_LEN + 1];
+	char *line, *next = phys_descr;
+
+        if (!vt || !buffer)
+                return -EINVAL;
+
+        if (count > WRITE_BUF_MAX_LEN) {
+                count = WRITE_BUF_MAX_LEN;
+        }
+        if (copy_from_user(phys_descr, buffer, count))
+                return -EFAULT;
+	phys_descr[count] = '\0';
+
+	while ((line = strsep(&next, "\n")) != NULL)
+		if (*line)
+			bind_kbd_phys(vt, line);
+	return count;
+}
+
+static int
+read_uni_screen(char *page, char **start, off_t off, int count, int *eof, void *data)
+{
+        struct vt_struct *vt = (struct vt_struct*) data;
+        int len;
+
+	if(!vt) return 0;
+
+        len = sprintf(page, "%d\n", vt->vt_uni_screen);
+
+        return generic_read(page, start, off, count, eof, len);
+}
+
+/*
+ * Writing 1 makes every VC of this VT keep a Unicode shadow of its
+ * screen (4 bytes per character cell), writing 0 frees them again.
+ */
+static int
+write_uni_screen(struct file *file, const char *buffer,
+		 unsigned long count, void *data)
+{
+        struct vt_struct *vt = (struct vt_struct*) data;
+	int i, err = 0;
+	char c;
+
+        if (!vt || !buffer || !count)
+                return -EINVAL;
+        if (get_user(c, buffer))
+                return -EFAULT;
+	if (c != '0' && c != '1')
+		return -EINVAL;
+
+	acquire_console_sem();
+	vt->vt_uni_screen = c - '0';
+	for (i = 0; i < vt->vc_count; i++) {
+		struct vc_data *vc = vt->vc_cons[i];
+
+		if (!vc)
+			continue;
+		if (!vt->vt_uni_screen)
+			vc_uniscr_free(vc);
+		else if (vc_uniscr_alloc(vc))
+			err = -ENOMEM;
+	}
+	release_console_sem();
+	return err ? err : count;
+}
+
+/*
+ * Selection paste progress, one line per allocated VC:
+ * <vc> <bytes pending> <bytes pasted> <pastes started> <pastes cancelled>
+ */
+static int
+read_paste(char *page, char **start, off_t off, int count, int *eof, void *data)
+{
+        struct vt_struct *vt = (struct vt_struct*) data;
+        int i, len = 0;
+
+	if(!vt) return 0;
+
+	for (i = 0; i < vt->vc_count; i++) {
+		struct vc_data *vc = vt->vc_cons[i];
+
+		if (!vc)
+			continue;
+		len += sprintf(page + len, "%d %u %lu %u %u\n", vc->vc_num + 1,
+			       vc->paste_len - vc->paste_pos, vc->paste_bytes,
+			       vc->paste_count, vc->paste_cancelled);
+	}
+
+        return generic_read(page, start, off, count, eof, len);
+}
+
+/*
+ * Keyboard input lost because the tty flip buffer was full, one line
+ * per allocated VC: <vc> <characters lost>
+ */
+static int
+read_kbd_overruns(char *page, char **start, off_t off, int count, int *eof, void *data)
+{
+        struct vt_struct *vt = (struct vt_struct*) data;
+        int i, len = 0;
+
+	if(!vt) return 0;
+
+	for (i = 0; i < vt->vc_count; i++) {
+		struct vc_data *vc = vt->vc_cons[i];
+
+		if (!vc)
+			continue;
+		len += sprintf(page + len, "%d %lu\n", vc->vc_num + 1,
+			       vc->kbd_overruns);
+	}
+
+        return generic_read(page, start, off, count, eof, len);
+}
+
+/*
+ * Keyboard latency histograms, one line per stage (input, queue, ldisc)
+ * with KBD_LAT_BUCKETS counts, see <linux/vt_kern.h>.  Writing 1 clears
+ * and starts them, writing 0 stops them.
+ */
+static int
+read_latency(char *page, char **start, off_t off, int count, int *eof, void *data)
+{
+        struct vt_struct *vt = (struct vt_struct*) data;
+	static const char *stage[KBD_LAT_STAGES] = { "input", "queue", "ldisc" };
+        int i, j, len = 0;
+
+	if(!vt) return 0;
+
+	len += sprintf(page + len, "%d\n", vt->vt_latency_on);
+	for (i = 0; vt->vt_latency && i < KBD_LAT_STAGES; i++) {
+		len += sprintf(page + len, "%s", stage[i]);
+		for (j = 0; j < KBD_LAT_BUCKETS; j++)
+			len += sprintf(page + len, " %lu", vt->vt_latency->hist[i][j]);
+		len += sprintf(page + len, "\n");
+	}
+
+        return generic_read(page, start, off, count, eof, len);
+}
+
+static int
+write_latency(struct file *file, const char *buffer,
+	      unsigned long count, void *data)
+{
+        struct vt_struct *vt = (struct vt_struct*) data;
+	char c;
+
+        if (!vt || !buffer || !count)
+                return -EINVAL;
+        if (get_user(c, buffer))
+                return -EFAULT;
+	if (c != '0' && c != '1')
+		return -EINVAL;
+
+	vt->vt_latency_on = 0;
+	if (c == '1') {
+		/* never freed, the keyboard may still be using it */
+		if (!vt->vt_latency &&
+		    !(vt->vt_latency = kmalloc(sizeof(struct kbd_latency), GFP_KERNEL)))
+			return -ENOMEM;
+		memset(vt->vt_latency, 0, sizeof(struct kbd_latency));
+		vt->vt_latency_on = 1;
+	}
+	return count;
+}
+
+static int
+read_bell(char *page, char **start, off_t off, int count, int *eof, void *data)
+{
+        struct vt_struct *vt = (struct vt_struct*) data;
+        int len;
+
+	if(!vt) return 0;
+
+        len = sprintf(page, "%d\n", vt->vt_bell_mode);
+
+        return generic_read(page, start, off, count, eof, len);
+}
+
+/*
+ * Writing 0 makes bells audible, 1 visual, 2 both.
+ */
+static int
+write_bell(struct file *file, const char *buffer,
+	   unsigned long count, void *data)
+{
+        struct vt_struct *vt = (struct vt_struct*) data;
+	char c;
+
+        if (!vt || !buffer || !count)
+                return -EINVAL;
+        if (get_user(c, buffer))
+                return -EFAULT;
+	if (c < '0' + VT_BELL_AUDIBLE || c > '0' + VT_BELL_BOTH)
+		return -EINVAL;
+
+	vt->vt_bell_mode = c - '0';
 	return count;
 }
 
 static vt_proc_entry vt_proc_list[] = {
         {"display_desc",       read_display_desc,             0, 0},
         {"keyboard",           read_kbd_phys,    write_kbd_phys, 0},
+        {"unicode_screen",     read_uni_screen,  write_uni_screen, 0},
+        {"paste",              read_paste,                    0, 0},
+        {"kbd_overruns",       read_kbd_overruns,             0, 0},
+        {"latency",            read_latency,      write_latency, 0},
+        {"bell",               read_bell,            write_bell, 0},
         {"", 0, 0, 0}
 };
 
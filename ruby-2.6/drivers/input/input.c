@@ -14,7 +14,10 @@
 #include <linux/sched.h>
 #include <linux/smp_lock.h>
 #include <linux/input.h>
+#include <linux/input_frame.h>
+#include <linux/input_absfilter.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/random.h>
 #include <linux/major.h>
 #include <linux/proc_fs.h>
@@ -23,6 +26,13 @@
 #include <linux/poll.h>
 #include <linux/device.h>
 #include <linux/devfs_fs_kernel.h>
+#include <linux/hash.h>
+#include <linux/dcache.h>
+#include <linux/slab.h>
+#include <linux/seq_file.h>
+#include <linux/rcupdate.h>
+
+#include <asm/uaccess.h>
 
 MODULE_AUTHOR("Vojtech Pavlik <vojtech@suse.cz>");
 MODULE_DESCRIPTION("Input core");
@@ -39,29 +49,186 @@ EXPORT_SYMBOL(input_close_device);
 EXPORT_SYMBOL(input_accept_process);
 EXPORT_SYMBOL(input_flush_device);
 EXPORT_SYMBOL(input_event);
+EXPORT_SYMBOL(input_events);
+EXPORT_SYMBOL(input_set_timestamp);
+EXPORT_SYMBOL(input_get_timestamp);
+EXPORT_SYMBOL(input_register_batch);
+EXPORT_SYMBOL(input_unregister_batch);
+EXPORT_SYMBOL(input_cursor_attach);
+EXPORT_SYMBOL(input_cursor_detach);
+EXPORT_SYMBOL(input_cursor_read);
+EXPORT_SYMBOL(input_cursor_frame);
+EXPORT_SYMBOL(input_absfilter_ioctl);
 EXPORT_SYMBOL(input_class);
 
 #define INPUT_DEVICES	256
 
 static LIST_HEAD(input_dev_list);
 static LIST_HEAD(input_handler_list);
+static LIST_HEAD(input_batch_list);
 
 static struct input_handler *input_table[8];
 
+/*
+ * What the core keeps per device beyond struct input_dev, found by
+ * device pointer.
+ */
+#define INPUT_STATE_HASH_BITS	4
+#define INPUT_BATCH_SLOTS	4
+
+/* A handle of the device whose handler takes whole frames */
+struct input_batch_slot {
+	struct input_handle *handle;
+	struct input_batch *batch;
+};
+
+struct input_dev_state {
+	struct input_dev *dev;
+	struct hlist_node node;
+	struct hlist_node phys_node;	/* hashed by dev->phys, if any */
+	struct input_ring *ring;
+	char *desc;		/* cached /proc/bus/input/devices text */
+	struct list_head rep_node;	/* on input_repeat_list while repeating */
+	unsigned long rep_expires;
+	int rep_off;			/* going away, never queue again */
+	unsigned int motion;		/* motion events since the last sample */
+	unsigned long entropy_fed;
+	unsigned long entropy_skipped;
+	struct input_axis_filter *axes;	/* ABS_MAX + 1, once a filter is set */
+	unsigned long long stamp;	/* source timestamp of this frame, or 0 */
+	struct input_batch_slot batched[INPUT_BATCH_SLOTS];
+};
+
+struct input_axis_filter {
+	struct input_absfilter conf;
+	long long acc;		/* smoothed value << 16 */
+	int primed;
+};
+
+static void input_repeat_start(struct input_dev *dev);
+static void input_repeat_stop(struct input_dev *dev);
+
+static struct hlist_head input_state_hash[1 << INPUT_STATE_HASH_BITS];
+static struct hlist_head input_phys_hash[1 << INPUT_STATE_HASH_BITS];
+
+static inline struct hlist_head *input_phys_head(const char *phys)
+{
+	return &input_phys_hash[hash_long(full_name_hash(phys, strlen(phys)), INPUT_STATE_HASH_BITS)];
+}
+
 #ifdef CONFIG_PROC_FS
 static struct proc_dir_entry *proc_bus_input_dir;
 static DECLARE_WAIT_QUEUE_HEAD(input_devices_poll_wait);
 static int input_devices_state;
 #endif
 
-void input_event(struct input_dev *dev, unsigned int type, unsigned int code, int value)
+/*
+ * The chains are walked under rcu_read_lock(), from interrupts too, and
+ * changed under input_state_lock; unregistering waits for the walkers
+ * before it frees a state.  The state found stays as long as its device.
+ */
+static spinlock_t input_state_lock = SPIN_LOCK_UNLOCKED;
+
+static struct input_dev_state *input_state(struct input_dev *dev)
 {
-	struct input_handle *handle;
+	struct input_dev_state *st;
+	struct hlist_node *n;
+
+	rcu_read_lock();
+	hlist_for_each_rcu(n, &input_state_hash[hash_ptr(dev, INPUT_STATE_HASH_BITS)]) {
+		st = hlist_entry(n, struct input_dev_state, node);
+		if (st->dev == dev) {
+			rcu_read_unlock();
+			return st;
+		}
+	}
+	rcu_read_unlock();
+	return NULL;
+}
 
-	if (type > EV_MAX || !test_bit(type, dev->evbit))
-		return;
+/*
+ * Entropy is taken from events that passed the filter: from every key
+ * press and release, and from one in entropy_sample motion events (none
+ * if 0).  Autorepeat and output events carry none.
+ */
+static unsigned int entropy_sample = 16;
+module_param(entropy_sample, uint, 0644);
+MODULE_PARM_DESC(entropy_sample, "Feed one in this many motion events to the entropy pool, 0 for none");
+
+static void input_entropy(struct input_dev_state *st, unsigned int type, unsigned int code, int value)
+{
+	switch (type) {
+		case EV_KEY:
+			if (value == 2)
+				return;
+			break;
+		case EV_REL:
+		case EV_ABS:
+			if (!st)
+				return;
+			if (!entropy_sample || ++st->motion < entropy_sample) {
+				st->entropy_skipped++;
+				return;
+			}
+			st->motion = 0;
+			break;
+		default:
+			return;
+	}
 
 	add_input_randomness(type, code, value);
+	if (st)
+		st->entropy_fed++;
+}
+
+/*
+ * The absfilter chain of one axis, ahead of absfuzz.  Returns zero to
+ * drop the event.
+ */
+static int input_abs_filter(struct input_dev *dev, struct input_axis_filter *af,
+			    unsigned int code, int *valp)
+{
+	struct input_absfilter *f = &af->conf;
+	int value = *valp, last = dev->abs[code];
+	int centre = (dev->absmin[code] + dev->absmax[code]) / 2;
+
+	if (f->deadzone && abs(value - centre) <= f->deadzone)
+		value = centre;
+	else if (f->hysteresis && abs(value - last) < f->hysteresis)
+		return 0;
+
+	if (f->smoothing) {
+		if (!af->primed) {
+			af->acc = (long long) last << 16;
+			af->primed = 1;
+		}
+		af->acc += ((((long long) value << 16) - af->acc) * f->smoothing) >> 8;
+		value = (int) ((af->acc + (1 << 15)) >> 16);
+	}
+
+	if (f->rate) {
+		if (value > last + f->rate)
+			value = last + f->rate;
+		else if (value < last - f->rate)
+			value = last - f->rate;
+	}
+
+	*valp = value;
+	return 1;
+}
+
+/*
+ * Updates the device state for one event.  Returns zero when the event
+ * is to be dropped, otherwise the (possibly smoothed) value is left in
+ * *valp for the handlers.
+ */
+static int input_filter(struct input_dev *dev, struct input_dev_state *st,
+			unsigned int type, unsigned int code, int *valp)
+{
+	int value = *valp;
+
+	if (type > EV_MAX || !test_bit(type, dev->evbit))
+		return 0;
 
 	switch (type) {
 
@@ -72,7 +239,7 @@ void input_event(struct input_dev *dev, unsigned int type, unsigned int code, in
 					break;
 
 				case SYN_REPORT:
-					if (dev->sync) return;
+					if (dev->sync) return 0;
 					dev->sync = 1;
 					break;
 			}
@@ -81,7 +248,7 @@ void input_event(struct input_dev *dev, unsigned int type, unsigned int code, in
 		case EV_KEY:
 
 			if (code > KEY_MAX || !test_bit(code, dev->keybit) || !!test_bit(code, dev->key) == value)
-				return;
+				return 0;
 
 			if (value == 2)
 				break;
@@ -90,20 +257,24 @@ void input_event(struct input_dev *dev, unsigned int type, unsigned int code, in
 
 			if (test_bit(EV_REP, dev->evbit) && dev->rep[REP_PERIOD] && dev->rep[REP_DELAY] && dev->timer.data && value) {
 				dev->repeat_key = code;
-				mod_timer(&dev->timer, jiffies + msecs_to_jiffies(dev->rep[REP_DELAY]));
-			}
+				input_repeat_start(dev);
+			} else if (!value && code == dev->repeat_key)
+				input_repeat_stop(dev);
 
 			break;
 
 		case EV_ABS:
 
 			if (code > ABS_MAX || !test_bit(code, dev->absbit))
-				return;
+				return 0;
+
+			if (st && st->axes && !input_abs_filter(dev, &st->axes[code], code, &value))
+				return 0;
 
 			if (dev->absfuzz[code]) {
 				if ((value > dev->abs[code] - (dev->absfuzz[code] >> 1)) &&
 				    (value < dev->abs[code] + (dev->absfuzz[code] >> 1)))
-					return;
+					return 0;
 
 				if ((value > dev->abs[code] - dev->absfuzz[code]) &&
 				    (value < dev->abs[code] + dev->absfuzz[code]))
@@ -115,7 +286,7 @@ void input_event(struct input_dev *dev, unsigned int type, unsigned int code, in
 			}
 
 			if (dev->abs[code] == value)
-				return;
+				return 0;
 
 			dev->abs[code] = value;
 			break;
@@ -123,14 +294,14 @@ void input_event(struct input_dev *dev, unsigned int type, unsigned int code, in
 		case EV_REL:
 
 			if (code > REL_MAX || !test_bit(code, dev->relbit) || (value == 0))
-				return;
+				return 0;
 
 			break;
 
 		case EV_MSC:
 
 			if (code > MSC_MAX || !test_bit(code, dev->mscbit))
-				return;
+				return 0;
 
 			if (dev->event) dev->event(dev, type, code, value);
 
@@ -139,7 +310,7 @@ void input_event(struct input_dev *dev, unsigned int type, unsigned int code, in
 		case EV_LED:
 
 			if (code > LED_MAX || !test_bit(code, dev->ledbit) || !!test_bit(code, dev->led) == value)
-				return;
+				return 0;
 
 			change_bit(code, dev->led);
 			if (dev->event) dev->event(dev, type, code, value);
@@ -149,7 +320,7 @@ void input_event(struct input_dev *dev, unsigned int type, unsigned int code, in
 		case EV_SND:
 
 			if (code > SND_MAX || !test_bit(code, dev->sndbit))
-				return;
+				return 0;
 
 			if (dev->event) dev->event(dev, type, code, value);
 
@@ -157,7 +328,7 @@ void input_event(struct input_dev *dev, unsigned int type, unsigned int code, in
 
 		case EV_REP:
 
-			if (code > REP_MAX || value < 0 || dev->rep[code] == value) return;
+			if (code > REP_MAX || value < 0 || dev->rep[code] == value) return 0;
 
 			dev->rep[code] = value;
 			if (dev->event) dev->event(dev, type, code, value);
@@ -172,12 +343,401 @@ void input_event(struct input_dev *dev, unsigned int type, unsigned int code, in
 	if (type != EV_SYN)
 		dev->sync = 0;
 
+	input_entropy(st, type, code, value);
+
+	*valp = value;
+	return 1;
+}
+
+/*
+ * Single writer: events of one device come from its driver one at a
+ * time.  Readers check next after copying an event to see whether it
+ * was overwritten meanwhile.  The ring is looked up under
+ * rcu_read_lock(), input_cursor_detach() waits for that before freeing.
+ */
+static void input_ring_write(struct input_dev_state *st, struct input_value *vals, unsigned int count)
+{
+	struct input_ring *ring;
+	unsigned long long stamp;
+	unsigned int head, i;
+
+	if (!st)
+		return;
+	rcu_read_lock();
+	if (!(ring = st->ring)) {
+		rcu_read_unlock();
+		return;
+	}
+
+	stamp = st->stamp ? st->stamp : sched_clock();
+	head = ring->head;
+	ring->next = head + count;
+	smp_wmb();
+	for (i = 0; i < count; i++) {
+		struct input_ring_event *ev = &ring->events[(head + i) & (INPUT_RING_SIZE - 1)];
+
+		ev->stamp = stamp;
+		ev->type = vals[i].type;
+		ev->code = vals[i].code;
+		ev->value = vals[i].value;
+	}
+	smp_wmb();
+	ring->frame = head;
+	ring->head = head + count;
+	rcu_read_unlock();
+}
+
+void input_event(struct input_dev *dev, unsigned int type, unsigned int code, int value)
+{
+	struct input_dev_state *st = input_state(dev);
+	struct input_handle *handle;
+	struct input_value val;
+
+	if (!input_filter(dev, st, type, code, &value))
+		goto out;
+
+	val.type = type;
+	val.code = code;
+	val.value = value;
+	input_ring_write(st, &val, 1);
+
 	if (dev->grab)
 		dev->grab->handler->event(dev->grab, type, code, value);
 	else
 		list_for_each_entry(handle, &dev->h_list, d_node)
 			if (handle->open)
 				handle->handler->event(handle, type, code, value);
+out:
+	/* a source timestamp is good for one frame */
+	if (st && type == EV_SYN && code == SYN_REPORT)
+		st->stamp = 0;
+}
+
+static void input_pass_values(struct input_dev_state *st, struct input_handle *handle,
+			      struct input_value *vals, unsigned int count)
+{
+	unsigned int i;
+
+	if (st)
+		for (i = 0; i < INPUT_BATCH_SLOTS; i++)
+			if (st->batched[i].handle == handle) {
+				smp_rmb();
+				st->batched[i].batch->events(handle, vals, count);
+				return;
+			}
+
+	for (i = 0; i < count; i++)
+		handle->handler->event(handle, vals[i].type, vals[i].code, vals[i].value);
+}
+
+/*
+ * Delivers a whole frame, normally ending with SYN_REPORT.  The events
+ * are filtered like those of input_event(); the accepted ones are packed
+ * at the start of vals and go to each handler in one call if it has an
+ * input_batch, so the array is modified.
+ */
+void input_events(struct input_dev *dev, struct input_value *vals, unsigned int count)
+{
+	struct input_dev_state *st = input_state(dev);
+	struct input_handle *handle;
+	unsigned int i, n = 0;
+	int sync = 0;
+
+	for (i = 0; i < count; i++) {
+		int value = vals[i].value;
+
+		if (vals[i].type == EV_SYN && vals[i].code == SYN_REPORT)
+			sync = 1;
+
+		if (!input_filter(dev, st, vals[i].type, vals[i].code, &value))
+			continue;
+		vals[n].type = vals[i].type;
+		vals[n].code = vals[i].code;
+		vals[n].value = value;
+		n++;
+	}
+
+	if (!n)
+		goto out;
+
+	input_ring_write(st, vals, n);
+
+	if (dev->grab)
+		input_pass_values(st, dev->grab, vals, n);
+	else
+		list_for_each_entry(handle, &dev->h_list, d_node)
+			if (handle->open)
+				input_pass_values(st, handle, vals, n);
+out:
+	if (st && sync)
+		st->stamp = 0;
+}
+
+/*
+ * Drivers that know when a frame really happened, like the interrupt
+ * time of a serio byte or the frame time of a USB report, pass it here
+ * (in sched_clock() nanoseconds) before they send the frame.  It stamps
+ * the events in the ring instead of the time of their arrival, up to
+ * and including the SYN_REPORT, so only drivers that end their frames
+ * with one may use it.  Autorepeats are never stamped with it.
+ */
+void input_set_timestamp(struct input_dev *dev, unsigned long long stamp)
+{
+	struct input_dev_state *st = input_state(dev);
+
+	if (st)
+		st->stamp = stamp;
+}
+
+/*
+ * For handlers, while an event is being passed to them: when the frame
+ * happened, as well as it is known.
+ */
+unsigned long long input_get_timestamp(struct input_dev *dev)
+{
+	struct input_dev_state *st = input_state(dev);
+
+	if (st && st->stamp)
+		return st->stamp;
+	return sched_clock();
+}
+
+/*
+ * Handlers that can take a frame at a time register their events()
+ * callback along with the handler.  The callback is looked up when a
+ * handle is linked, or when it is registered for handles linked before,
+ * and kept in a slot of the device state; a device with more batching
+ * handles than slots gets the events of the others one by one.
+ */
+static struct input_batch *input_batch_of(struct input_handler *handler)
+{
+	struct input_batch *batch;
+
+	list_for_each_entry(batch, &input_batch_list, node)
+		if (batch->handler == handler)
+			return batch;
+	return NULL;
+}
+
+static void input_batch_bind(struct input_handle *handle, struct input_batch *batch)
+{
+	struct input_dev_state *st = input_state(handle->dev);
+	int i;
+
+	if (!st)
+		return;
+	for (i = 0; i < INPUT_BATCH_SLOTS; i++)
+		if (!st->batched[i].handle) {
+			st->batched[i].batch = batch;
+			smp_wmb();
+			st->batched[i].handle = handle;
+			return;
+		}
+}
+
+static void input_batch_unbind(struct input_handle *handle)
+{
+	struct input_dev_state *st = input_state(handle->dev);
+	int i;
+
+	if (!st)
+		return;
+	for (i = 0; i < INPUT_BATCH_SLOTS; i++)
+		if (st->batched[i].handle == handle)
+			st->batched[i].handle = NULL;
+}
+
+static int input_handler_registered(struct input_handler *handler)
+{
+	struct input_handler *h;
+
+	list_for_each_entry(h, &input_handler_list, node)
+		if (h == handler)
+			return 1;
+	return 0;
+}
+
+void input_register_batch(struct input_batch *batch)
+{
+	struct input_handle *handle;
+
+	list_add_tail(&batch->node, &input_batch_list);
+	if (input_handler_registered(batch->handler))
+		list_for_each_entry(handle, &batch->handler->h_list, h_node)
+			input_batch_bind(handle, batch);
+}
+
+void input_unregister_batch(struct input_batch *batch)
+{
+	struct input_handle *handle;
+
+	if (input_handler_registered(batch->handler))
+		list_for_each_entry(handle, &batch->handler->h_list, h_node)
+			input_batch_unbind(handle);
+	list_del_init(&batch->node);
+}
+
+/*
+ * The ring of a device is allocated for its first reader and freed
+ * with the last one.
+ */
+int input_cursor_attach(struct input_cursor *cursor, struct input_dev *dev)
+{
+	struct input_dev_state *st = input_state(dev);
+	struct input_ring *ring;
+
+	if (!st)
+		return -ENODEV;
+	if (!(ring = st->ring)) {
+		if (!(ring = kmalloc(sizeof(struct input_ring), GFP_KERNEL)))
+			return -ENOMEM;
+		memset(ring, 0, sizeof(struct input_ring));
+		ring->dev = dev;
+		smp_wmb();
+		st->ring = ring;
+	}
+	ring->users++;
+	cursor->ring = ring;
+	cursor->tail = ring->head;
+	cursor->overrun = 0;
+	return 0;
+}
+
+void input_cursor_detach(struct input_cursor *cursor)
+{
+	struct input_ring *ring = cursor->ring;
+
+	if (!ring)
+		return;
+	cursor->ring = NULL;
+	if (--ring->users)
+		return;
+	input_state(ring->dev)->ring = NULL;
+	/* the driver may be writing to it on another CPU */
+	synchronize_kernel();
+	kfree(ring);
+}
+
+/*
+ * Copies the next event out and returns 1, or returns 0 when the reader
+ * has caught up.
+ */
+int input_cursor_read(struct input_cursor *cursor, struct input_ring_event *ev)
+{
+	struct input_ring *ring = cursor->ring;
+	unsigned int head;
+
+	for (;;) {
+		head = ring->head;
+		smp_rmb();
+		if (cursor->tail == head)
+			return 0;
+		if (head - cursor->tail > INPUT_RING_SIZE) {
+			cursor->tail = head - INPUT_RING_SIZE;
+			cursor->overrun = 1;
+		}
+		*ev = ring->events[cursor->tail & (INPUT_RING_SIZE - 1)];
+		smp_rmb();
+		if (ring->next - cursor->tail <= INPUT_RING_SIZE) {
+			cursor->tail++;
+			return 1;
+		}
+		/* overwritten while we copied it */
+	}
+}
+
+/*
+ * Skips ahead to the start of the last write, for handlers that are
+ * called from the dispatch of that write and only want what it
+ * brought.  A cursor already past that point is left alone.
+ */
+void input_cursor_frame(struct input_cursor *cursor)
+{
+	struct input_ring *ring = cursor->ring;
+
+	if ((int) (ring->frame - cursor->tail) > 0)
+		cursor->tail = ring->frame;
+}
+
+/*
+ * EVIOCGABSFILTER and EVIOCSABSFILTER, for the ioctl of event device
+ * handlers to pass on.
+ */
+int input_absfilter_ioctl(struct input_dev *dev, unsigned int cmd, void __user *p)
+{
+	struct input_dev_state *st = input_state(dev);
+	struct input_axis_filter *axes;
+	struct input_absfilter f;
+	unsigned long flags;
+
+	if (!st)
+		return -ENODEV;
+	if (copy_from_user(&f, p, sizeof(f)))
+		return -EFAULT;
+	if (f.axis > ABS_MAX || !test_bit(f.axis, dev->absbit))
+		return -EINVAL;
+
+	switch (cmd) {
+		case EVIOCGABSFILTER:
+			if (st->axes)
+				f = st->axes[f.axis].conf;
+			else
+				memset(&f.smoothing, 0, sizeof(f) - sizeof(f.axis));
+			return copy_to_user(p, &f, sizeof(f)) ? -EFAULT : 0;
+
+		case EVIOCSABSFILTER:
+			if (f.smoothing > 256 || f.deadzone < 0 || f.hysteresis < 0 || f.rate < 0)
+				return -EINVAL;
+			if (f.smoothing == 256)
+				f.smoothing = 0;
+			if (!st->axes) {
+				axes = kmalloc((ABS_MAX + 1) * sizeof(struct input_axis_filter), GFP_KERNEL);
+				if (!axes)
+					return -ENOMEM;
+				memset(axes, 0, (ABS_MAX + 1) * sizeof(struct input_axis_filter));
+				local_irq_save(flags);
+				if (!st->axes)
+					st->axes = axes;
+				else
+					kfree(axes);
+				local_irq_restore(flags);
+			}
+			local_irq_save(flags);
+			st->axes[f.axis].conf = f;
+			st->axes[f.axis].primed = 0;
+			local_irq_restore(flags);
+			return 0;
+	}
+	return -EINVAL;
+}
+
+/*
+ * Autorepeat.  Devices with a key held down sit on one list sorted by
+ * the time of their next repeat, and a single timer fires for the head
+ * of it, sending all the repeats that are due by then in one go.  Only
+ * a device the core has no state for uses its own timer.
+ */
+static LIST_HEAD(input_repeat_list);
+static spinlock_t input_repeat_lock = SPIN_LOCK_UNLOCKED;
+static void input_repeat_fire(unsigned long data);
+static struct timer_list input_repeat_timer = TIMER_INITIALIZER(input_repeat_fire, 0, 0);
+static struct input_dev_state *input_repeat_busy;	/* being sent, unlocked */
+
+/* called with input_repeat_lock held */
+static void input_repeat_queue(struct input_dev_state *st, unsigned long expires)
+{
+	struct input_dev_state *pos;
+
+	if (st->rep_off)
+		return;
+	list_del_init(&st->rep_node);
+	st->rep_expires = expires;
+	list_for_each_entry(pos, &input_repeat_list, rep_node)
+		if (time_before(expires, pos->rep_expires))
+			break;
+	list_add_tail(&st->rep_node, &pos->rep_node);
+	if (input_repeat_list.next == &st->rep_node)
+		mod_timer(&input_repeat_timer, expires);
 }
 
 static void input_repeat_key(unsigned long data)
@@ -194,6 +754,96 @@ static void input_repeat_key(unsigned long data)
 		mod_timer(&dev->timer, jiffies + msecs_to_jiffies(dev->rep[REP_PERIOD]));
 }
 
+static void input_repeat_fire(unsigned long data)
+{
+	struct input_dev_state *st;
+	struct input_dev *dev;
+	unsigned long flags;
+	LIST_HEAD(due);
+
+	spin_lock_irqsave(&input_repeat_lock, flags);
+	while (!list_empty(&input_repeat_list)) {
+		st = list_entry(input_repeat_list.next, struct input_dev_state, rep_node);
+		if (time_after(st->rep_expires, jiffies))
+			break;
+		list_move_tail(&st->rep_node, &due);
+	}
+
+	while (!list_empty(&due)) {
+		st = list_entry(due.next, struct input_dev_state, rep_node);
+		list_del_init(&st->rep_node);
+		dev = st->dev;
+		if (!test_bit(dev->repeat_key, dev->key))
+			continue;
+		/* input_repeat_forget() waits for us to be done with it */
+		input_repeat_busy = st;
+		st->stamp = 0;
+		spin_unlock_irqrestore(&input_repeat_lock, flags);
+
+		input_event(dev, EV_KEY, dev->repeat_key, 2);
+		input_sync(dev);
+
+		spin_lock_irqsave(&input_repeat_lock, flags);
+		input_repeat_busy = NULL;
+		/* a new press may have queued it meanwhile */
+		if (list_empty(&st->rep_node) && dev->rep[REP_PERIOD])
+			input_repeat_queue(st, jiffies + msecs_to_jiffies(dev->rep[REP_PERIOD]));
+	}
+
+	if (!list_empty(&input_repeat_list)) {
+		st = list_entry(input_repeat_list.next, struct input_dev_state, rep_node);
+		mod_timer(&input_repeat_timer, st->rep_expires);
+	}
+	spin_unlock_irqrestore(&input_repeat_lock, flags);
+}
+
+static void input_repeat_start(struct input_dev *dev)
+{
+	struct input_dev_state *st = input_state(dev);
+	unsigned long flags;
+
+	if (!st) {
+		mod_timer(&dev->timer, jiffies + msecs_to_jiffies(dev->rep[REP_DELAY]));
+		return;
+	}
+	spin_lock_irqsave(&input_repeat_lock, flags);
+	input_repeat_queue(st, jiffies + msecs_to_jiffies(dev->rep[REP_DELAY]));
+	spin_unlock_irqrestore(&input_repeat_lock, flags);
+}
+
+static void input_repeat_stop(struct input_dev *dev)
+{
+	struct input_dev_state *st = input_state(dev);
+	unsigned long flags;
+
+	if (!st)
+		return;
+	spin_lock_irqsave(&input_repeat_lock, flags);
+	list_del_init(&st->rep_node);
+	spin_unlock_irqrestore(&input_repeat_lock, flags);
+}
+
+/*
+ * Takes a device that is going away off the repeat list for good.  The
+ * timer may be sending its repeat on another CPU right now, and the
+ * device has to stay until it is done; the timer itself keeps running
+ * for the others.
+ */
+static void input_repeat_forget(struct input_dev_state *st)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&input_repeat_lock, flags);
+	st->rep_off = 1;
+	list_del_init(&st->rep_node);
+	while (input_repeat_busy == st) {
+		spin_unlock_irqrestore(&input_repeat_lock, flags);
+		cpu_relax();
+		spin_lock_irqsave(&input_repeat_lock, flags);
+	}
+	spin_unlock_irqrestore(&input_repeat_lock, flags);
+}
+
 int input_accept_process(struct input_handle *handle, struct file *file)
 {
 	if (handle->dev->accept)
@@ -241,8 +891,30 @@ void input_close_device(struct input_handle *handle)
 	handle->open--;
 }
 
+/* Guards st->desc against readers of /proc/bus/input/devices */
+static spinlock_t input_desc_lock = SPIN_LOCK_UNLOCKED;
+
+static void input_desc_invalidate(struct input_dev *dev)
+{
+	struct input_dev_state *st = input_state(dev);
+	char *desc;
+
+	if (!st)
+		return;
+	spin_lock(&input_desc_lock);
+	desc = st->desc;
+	st->desc = NULL;
+	spin_unlock(&input_desc_lock);
+	kfree(desc);
+}
+
 static void input_link_handle(struct input_handle *handle)
 {
+	struct input_batch *batch = input_batch_of(handle->handler);
+
+	input_desc_invalidate(handle->dev);
+	if (batch)
+		input_batch_bind(handle, batch);
 	list_add_tail(&handle->d_node, &handle->dev->h_list);
 	list_add_tail(&handle->h_node, &handle->handler->h_list);
 }
@@ -250,47 +922,205 @@ static void input_link_handle(struct input_handle *handle)
 #define MATCH_BIT(bit, max) \
 		for (i = 0; i < NBITS(max); i++) \
 			if ((id->bit[i] & dev->bit[i]) != id->bit[i]) \
-				break; \
-		if (i != NBITS(max)) \
-			continue;
+				return 0;
 
-static struct input_device_id *input_match_device(struct input_device_id *id, struct input_dev *dev)
+static int input_match_id(struct input_device_id *id, struct input_dev *dev)
 {
 	int i;
 
-	for (; id->flags || id->driver_info; id++) {
+	if (id->flags & INPUT_DEVICE_ID_MATCH_BUS)
+		if (id->id.bustype != dev->id.bustype)
+			return 0;
 
-		if (id->flags & INPUT_DEVICE_ID_MATCH_BUS)
-			if (id->id.bustype != dev->id.bustype)
-				continue;
+	if (id->flags & INPUT_DEVICE_ID_MATCH_VENDOR)
+		if (id->id.vendor != dev->id.vendor)
+			return 0;
 
-		if (id->flags & INPUT_DEVICE_ID_MATCH_VENDOR)
-			if (id->id.vendor != dev->id.vendor)
-				continue;
+	if (id->flags & INPUT_DEVICE_ID_MATCH_PRODUCT)
+		if (id->id.product != dev->id.product)
+			return 0;
 
-		if (id->flags & INPUT_DEVICE_ID_MATCH_PRODUCT)
-			if (id->id.product != dev->id.product)
-				continue;
+	if (id->flags & INPUT_DEVICE_ID_MATCH_VERSION)
+		if (id->id.version != dev->id.version)
+			return 0;
 
-		if (id->flags & INPUT_DEVICE_ID_MATCH_VERSION)
-			if (id->id.version != dev->id.version)
-				continue;
+	MATCH_BIT(evbit,  EV_MAX);
+	MATCH_BIT(keybit, KEY_MAX);
+	MATCH_BIT(relbit, REL_MAX);
+	MATCH_BIT(absbit, ABS_MAX);
+	MATCH_BIT(mscbit, MSC_MAX);
+	MATCH_BIT(ledbit, LED_MAX);
+	MATCH_BIT(sndbit, SND_MAX);
+	MATCH_BIT(ffbit,  FF_MAX);
 
-		MATCH_BIT(evbit,  EV_MAX);
-		MATCH_BIT(keybit, KEY_MAX);
-		MATCH_BIT(relbit, REL_MAX);
-		MATCH_BIT(absbit, ABS_MAX);
-		MATCH_BIT(mscbit, MSC_MAX);
-		MATCH_BIT(ledbit, LED_MAX);
-		MATCH_BIT(sndbit, SND_MAX);
-		MATCH_BIT(ffbit,  FF_MAX);
+	return 1;
+}
+
+static struct input_device_id *input_match_device(struct input_device_id *id, struct input_dev *dev)
+{
+	for (; id->flags || id->driver_info; id++)
+		if (input_match_id(id, dev))
+			return id;
 
-		return id;
+	return NULL;
+}
+
+/*
+ * Matching index.  The id tables of the handlers are split into entries
+ * filed under the vendor/product they ask for, or else under the lowest
+ * event type they require, so that a new device is only compared with
+ * the entries it can possibly satisfy.  Each handler still connects
+ * with the first entry of its table that matches, and the handlers are
+ * still tried in the order they registered.
+ */
+#define INPUT_ID_HASH_BITS	5
+
+struct input_handler_ids;
+
+struct input_id_entry {
+	struct input_device_id *id;
+	struct input_handler_ids *ids;
+	unsigned int order;
+	struct hlist_node node;
+};
+
+struct input_handler_ids {
+	struct input_handler *handler;
+	struct list_head node;
+	struct input_device_id *best;	/* while matching a device */
+	unsigned int best_order;
+	unsigned int count;
+	struct input_id_entry entries[0];
+};
+
+static LIST_HEAD(input_ids_list);
+static int input_unindexed;	/* handlers that had no memory for an index */
+static struct hlist_head input_id_product[1 << INPUT_ID_HASH_BITS];
+static struct hlist_head input_id_ev[EV_MAX + 1];
+static HLIST_HEAD(input_id_any);
+
+static inline struct hlist_head *input_id_product_head(unsigned int vendor, unsigned int product)
+{
+	return &input_id_product[hash_long((vendor << 16) | product, INPUT_ID_HASH_BITS)];
+}
+
+static struct input_handler_ids *input_index_handler(struct input_handler *handler)
+{
+	struct input_handler_ids *ids;
+	struct input_device_id *id;
+	struct input_id_entry *e;
+	unsigned int n = 0;
+
+	for (id = handler->id_table; id->flags || id->driver_info; id++)
+		n++;
+
+	ids = kmalloc(sizeof(struct input_handler_ids) + n * sizeof(struct input_id_entry), GFP_KERNEL);
+	if (!ids)
+		return NULL;
+	memset(ids, 0, sizeof(struct input_handler_ids) + n * sizeof(struct input_id_entry));
+	ids->handler = handler;
+	ids->count = n;
+
+	for (n = 0; n < ids->count; n++) {
+		e = &ids->entries[n];
+		e->id = id = &handler->id_table[n];
+		e->ids = ids;
+		e->order = n;
+		if ((id->flags & INPUT_DEVICE_ID_MATCH_VENDOR) &&
+		    (id->flags & INPUT_DEVICE_ID_MATCH_PRODUCT))
+			hlist_add_head(&e->node, input_id_product_head(id->id.vendor, id->id.product));
+		else if (id->evbit[0])
+			hlist_add_head(&e->node, &input_id_ev[__ffs(id->evbit[0])]);
+		else
+			hlist_add_head(&e->node, &input_id_any);
 	}
 
+	list_add_tail(&ids->node, &input_ids_list);
+	return ids;
+}
+
+static struct input_handler_ids *input_handler_ids(struct input_handler *handler)
+{
+	struct input_handler_ids *ids;
+
+	list_for_each_entry(ids, &input_ids_list, node)
+		if (ids->handler == handler)
+			return ids;
 	return NULL;
 }
 
+static void input_unindex_handler(struct input_handler *handler)
+{
+	struct input_handler_ids *ids = input_handler_ids(handler);
+	unsigned int n;
+
+	if (!ids) {
+		input_unindexed--;
+		return;
+	}
+	for (n = 0; n < ids->count; n++)
+		hlist_del(&ids->entries[n].node);
+	list_del(&ids->node);
+	kfree(ids);
+}
+
+/* The plain scan of the id table, for handlers without an index */
+static void input_connect_handler(struct input_handler *handler, struct input_dev *dev)
+{
+	struct input_handle *handle;
+	struct input_device_id *id;
+
+	if (!handler->blacklist || !input_match_device(handler->blacklist, dev))
+		if ((id = input_match_device(handler->id_table, dev)))
+			if ((handle = handler->connect(handler, dev, id)))
+				input_link_handle(handle);
+}
+
+static void input_try_ids(struct hlist_head *head, struct input_dev *dev)
+{
+	struct input_id_entry *e;
+	struct hlist_node *n;
+
+	hlist_for_each_entry(e, n, head, node) {
+		if (e->ids->best && e->ids->best_order <= e->order)
+			continue;
+		if (input_match_id(e->id, dev)) {
+			e->ids->best = e->id;
+			e->ids->best_order = e->order;
+		}
+	}
+}
+
+static void input_connect_handlers(struct input_dev *dev)
+{
+	struct input_handler_ids *ids;
+	struct input_handler *handler;
+	struct input_handle *handle;
+	struct input_device_id *id;
+	int i;
+
+	input_try_ids(input_id_product_head(dev->id.vendor, dev->id.product), dev);
+	for (i = 0; i <= EV_MAX; i++)
+		if (test_bit(i, dev->evbit))
+			input_try_ids(&input_id_ev[i], dev);
+	input_try_ids(&input_id_any, dev);
+
+	list_for_each_entry(ids, &input_ids_list, node) {
+		if (!(id = ids->best))
+			continue;
+		ids->best = NULL;
+		handler = ids->handler;
+		if (!handler->blacklist || !input_match_device(handler->blacklist, dev))
+			if ((handle = handler->connect(handler, dev, id)))
+				input_link_handle(handle);
+	}
+
+	if (input_unindexed)
+		list_for_each_entry(handler, &input_handler_list, node)
+			if (!input_handler_ids(handler))
+				input_connect_handler(handler, dev);
+}
+
 /*
  * Input hotplugging interface - loading event handlers based on
  * device bitfields.
@@ -325,41 +1155,13 @@ static struct input_device_id *input_match_device(struct input_device_id *id, st
 			SPRINTF_BIT_A(bit, name, max); \
 	} while (0)
 
-static void input_call_hotplug(char *verb, struct input_dev *dev)
+/*
+ * Fills envp with the variables describing dev, formatted into scratch
+ * (1024 bytes), and returns how many there are.
+ */
+static int input_hotplug_env(char *verb, struct input_dev *dev, char **envp, char *scratch)
 {
-	char *argv[3], **envp, *buf, *scratch;
-	int i = 0, j, value;
-
-	if (!hotplug_path[0]) {
-		printk(KERN_ERR "input.c: calling hotplug without a hotplug agent defined\n");
-		return;
-	}
-	if (in_interrupt()) {
-		printk(KERN_ERR "input.c: calling hotplug from interrupt\n");
-		return;
-	}
-	if (!current->fs->root) {
-		printk(KERN_WARNING "input.c: calling hotplug without valid filesystem\n");
-		return;
-	}
-	if (!(envp = (char **) kmalloc(20 * sizeof(char *), GFP_KERNEL))) {
-		printk(KERN_ERR "input.c: not enough memory allocating hotplug environment\n");
-		return;
-	}
-	if (!(buf = kmalloc(1024, GFP_KERNEL))) {
-		kfree (envp);
-		printk(KERN_ERR "input.c: not enough memory allocating hotplug environment\n");
-		return;
-	}
-
-	argv[0] = hotplug_path;
-	argv[1] = "input";
-	argv[2] = NULL;
-
-	envp[i++] = "HOME=/";
-	envp[i++] = "PATH=/sbin:/bin:/usr/sbin:/usr/bin";
-
-	scratch = buf;
+	int i = 0, j;
 
 	envp[i++] = scratch;
 	scratch += sprintf(scratch, "ACTION=%s", verb) + 1;
@@ -387,7 +1189,34 @@ static void input_call_hotplug(char *verb, struct input_dev *dev)
 	SPRINTF_BIT_A2(sndbit, "SND=", SND_MAX, EV_SND);
 	SPRINTF_BIT_A2(ffbit,  "FF=",  FF_MAX, EV_FF);
 
-	envp[i++] = NULL;
+	return i;
+}
+
+static int input_hotplug_check(void)
+{
+	if (!hotplug_path[0]) {
+		printk(KERN_ERR "input.c: calling hotplug without a hotplug agent defined\n");
+		return -1;
+	}
+	if (in_interrupt()) {
+		printk(KERN_ERR "input.c: calling hotplug from interrupt\n");
+		return -1;
+	}
+	if (!current->fs->root) {
+		printk(KERN_WARNING "input.c: calling hotplug without valid filesystem\n");
+		return -1;
+	}
+	return 0;
+}
+
+static void input_run_hotplug(char **envp)
+{
+	char *argv[3];
+	int value;
+
+	argv[0] = hotplug_path;
+	argv[1] = "input";
+	argv[2] = NULL;
 
 #ifdef INPUT_DEBUG
 	printk(KERN_DEBUG "input.c: calling %s %s [%s %s %s %s %s]\n",
@@ -396,25 +1225,184 @@ static void input_call_hotplug(char *verb, struct input_dev *dev)
 
 	value = call_usermodehelper(argv [0], argv, envp, 0);
 
-	kfree(buf);
-	kfree(envp);
-
 #ifdef INPUT_DEBUG
 	if (value != 0)
 		printk(KERN_DEBUG "input.c: hotplug returned %d\n", value);
 #endif
 }
 
+static void input_call_hotplug_now(char *verb, struct input_dev *dev)
+{
+	char **envp, *buf;
+	int i = 0;
+
+	if (input_hotplug_check())
+		return;
+	if (!(envp = (char **) kmalloc(20 * sizeof(char *), GFP_KERNEL))) {
+		printk(KERN_ERR "input.c: not enough memory allocating hotplug environment\n");
+		return;
+	}
+	if (!(buf = kmalloc(1024, GFP_KERNEL))) {
+		kfree (envp);
+		printk(KERN_ERR "input.c: not enough memory allocating hotplug environment\n");
+		return;
+	}
+
+	envp[i++] = "HOME=/";
+	envp[i++] = "PATH=/sbin:/bin:/usr/sbin:/usr/bin";
+	i += input_hotplug_env(verb, dev, envp + i, buf);
+	envp[i++] = NULL;
+
+	input_run_hotplug(envp);
+
+	kfree(buf);
+	kfree(envp);
+}
+
+/*
+ * Coalescing.  With hotplug_window set, the events are only recorded
+ * and handed to the agent once no new one came for that many
+ * milliseconds, or INPUT_HOTPLUG_SPAN windows after the first one of
+ * the batch at the latest.  They go up to INPUT_HOTPLUG_BATCH at a
+ * time, as ACTION=batch with EVENTS=n and the usual variables of event
+ * k suffixed by _k (ACTION_0, PRODUCT_0, ...).  0, the default, calls
+ * the agent for every event as before.
+ */
+#define INPUT_HOTPLUG_BATCH	16
+#define INPUT_HOTPLUG_SPAN	4
+
+static unsigned int hotplug_window;
+module_param(hotplug_window, uint, 0644);
+MODULE_PARM_DESC(hotplug_window, "Coalesce input hotplug events over this many ms, 0 for none");
+
+struct input_hotplug_rec {
+	struct list_head node;
+	int count;
+	char *envp[18];
+	char buf[1024];
+};
+
+static LIST_HEAD(input_hotplug_queue);
+static spinlock_t input_hotplug_lock = SPIN_LOCK_UNLOCKED;
+static unsigned long input_hotplug_first;	/* when the queue last became busy */
+static void input_hotplug_flush(void *data);
+static DECLARE_WORK(input_hotplug_work, input_hotplug_flush, NULL);
+
+static void input_hotplug_flush(void *data)
+{
+	struct input_hotplug_rec *rec, *next;
+	char **envp, *buf, *scratch, *eq;
+	unsigned long flags;
+	LIST_HEAD(batch);
+	int i, j, n = 0, size = 0;
+
+	spin_lock_irqsave(&input_hotplug_lock, flags);
+	while (!list_empty(&input_hotplug_queue) && n < INPUT_HOTPLUG_BATCH) {
+		rec = list_entry(input_hotplug_queue.next, struct input_hotplug_rec, node);
+		list_move_tail(&rec->node, &batch);
+		size += rec->count;
+		n++;
+	}
+	if (!list_empty(&input_hotplug_queue))
+		schedule_work(&input_hotplug_work);
+	spin_unlock_irqrestore(&input_hotplug_lock, flags);
+
+	if (!n || input_hotplug_check())
+		goto out;
+
+	/* a suffix adds at most 3 bytes to a variable */
+	envp = kmalloc((size + 5) * sizeof(char *), GFP_KERNEL);
+	buf = kmalloc(n * (1024 + 18 * 3) + 32, GFP_KERNEL);
+	if (!envp || !buf) {
+		printk(KERN_ERR "input.c: not enough memory allocating hotplug environment\n");
+		kfree(envp);
+		kfree(buf);
+		goto out;
+	}
+
+	i = 0;
+	envp[i++] = "HOME=/";
+	envp[i++] = "PATH=/sbin:/bin:/usr/sbin:/usr/bin";
+	envp[i++] = "ACTION=batch";
+	scratch = buf;
+	envp[i++] = scratch;
+	scratch += sprintf(scratch, "EVENTS=%d", n) + 1;
+
+	n = 0;
+	list_for_each_entry(rec, &batch, node) {
+		for (j = 0; j < rec->count; j++) {
+			eq = strchr(rec->envp[j], '=');
+			envp[i++] = scratch;
+			scratch += sprintf(scratch, "%.*s_%d%s", (int) (eq - rec->envp[j]),
+					   rec->envp[j], n, eq) + 1;
+		}
+		n++;
+	}
+	envp[i++] = NULL;
+
+	input_run_hotplug(envp);
+
+	kfree(buf);
+	kfree(envp);
+out:
+	list_for_each_entry_safe(rec, next, &batch, node)
+		kfree(rec);
+}
+
+static void input_call_hotplug(char *verb, struct input_dev *dev)
+{
+	struct input_hotplug_rec *rec;
+	unsigned long flags, delay, deadline;
+
+	if (!hotplug_window) {
+		input_call_hotplug_now(verb, dev);
+		return;
+	}
+
+	if (!(rec = kmalloc(sizeof(struct input_hotplug_rec), GFP_KERNEL))) {
+		printk(KERN_ERR "input.c: not enough memory allocating hotplug environment\n");
+		return;
+	}
+	rec->count = input_hotplug_env(verb, dev, rec->envp, rec->buf);
+
+	delay = msecs_to_jiffies(hotplug_window);
+	spin_lock_irqsave(&input_hotplug_lock, flags);
+	if (list_empty(&input_hotplug_queue))
+		input_hotplug_first = jiffies;
+	list_add_tail(&rec->node, &input_hotplug_queue);
+	deadline = input_hotplug_first + INPUT_HOTPLUG_SPAN * delay;
+	spin_unlock_irqrestore(&input_hotplug_lock, flags);
+
+	/* every new event pushes the batch back by a window, up to the span */
+	if (!time_before(jiffies, deadline))
+		delay = 0;
+	else if (time_after(jiffies + delay, deadline))
+		delay = deadline - jiffies;
+	cancel_delayed_work(&input_hotplug_work);
+	schedule_delayed_work(&input_hotplug_work, delay);
+}
+
 #endif
 
 void input_register_device(struct input_dev *dev)
 {
-	struct input_handle *handle;
-	struct input_handler *handler;
-	struct input_device_id *id;
+	struct input_dev_state *st;
+	unsigned long flags;
 
 	set_bit(EV_SYN, dev->evbit);
 
+	if ((st = kmalloc(sizeof(struct input_dev_state), GFP_KERNEL))) {
+		memset(st, 0, sizeof(struct input_dev_state));
+		st->dev = dev;
+		INIT_LIST_HEAD(&st->rep_node);
+		spin_lock_irqsave(&input_state_lock, flags);
+		hlist_add_head_rcu(&st->node, &input_state_hash[hash_ptr(dev, INPUT_STATE_HASH_BITS)]);
+		if (dev->phys)
+			hlist_add_head_rcu(&st->phys_node, input_phys_head(dev->phys));
+		spin_unlock_irqrestore(&input_state_lock, flags);
+	} else
+		printk(KERN_WARNING "input: no memory for the state of %s\n", dev->name);
+
 	/*
 	 * If delay and period are pre-set by the driver, then autorepeating
 	 * is handled by the driver itself and we don't do it in input.c.
@@ -424,18 +1412,14 @@ void input_register_device(struct input_dev *dev)
 	if (!dev->rep[REP_DELAY] && !dev->rep[REP_PERIOD]) {
 		dev->timer.data = (long) dev;
 		dev->timer.function = input_repeat_key;
-		dev->rep[REP_DELAY] = 250;
-		dev->rep[REP_PERIOD] = 33;
+		dev->rep[REP_DELAY] = INPUT_REP_DELAY_DEFAULT;
+		dev->rep[REP_PERIOD] = INPUT_REP_PERIOD_DEFAULT;
 	}
 
 	INIT_LIST_HEAD(&dev->h_list);
 	list_add_tail(&dev->node, &input_dev_list);
 
-	list_for_each_entry(handler, &input_handler_list, node)
-		if (!handler->blacklist || !input_match_device(handler->blacklist, dev))
-			if ((id = input_match_device(handler->id_table, dev)))
-				if ((handle = handler->connect(handler, dev, id)))
-					input_link_handle(handle);
+	input_connect_handlers(dev);
 
 #ifdef CONFIG_HOTPLUG
 	input_call_hotplug("add", dev);
@@ -450,18 +1434,36 @@ void input_register_device(struct input_dev *dev)
 void input_unregister_device(struct input_dev *dev)
 {
 	struct list_head * node, * next;
+	struct input_dev_state *st;
+	unsigned long flags;
 
 	if (!dev) return;
 
 	del_timer_sync(&dev->timer);
+	if ((st = input_state(dev)))
+		input_repeat_forget(st);
 
 	list_for_each_safe(node, next, &dev->h_list) {
 		struct input_handle * handle = to_handle(node);
+		input_batch_unbind(handle);
 		list_del_init(&handle->d_node);
 		list_del_init(&handle->h_node);
 		handle->handler->disconnect(handle);
 	}
 
+	if (st) {
+		spin_lock_irqsave(&input_state_lock, flags);
+		hlist_del_rcu(&st->node);
+		if (!hlist_unhashed(&st->phys_node))
+			hlist_del_rcu(&st->phys_node);
+		spin_unlock_irqrestore(&input_state_lock, flags);
+		/* input_state() may be walking past it for another device */
+		synchronize_kernel();
+		kfree(st->desc);
+		kfree(st->axes);
+		kfree(st);
+	}
+
 #ifdef CONFIG_HOTPLUG
 	input_call_hotplug("remove", dev);
 #endif
@@ -477,23 +1479,24 @@ void input_unregister_device(struct input_dev *dev)
 void input_register_handler(struct input_handler *handler)
 {
 	struct input_dev *dev;
-	struct input_handle *handle;
-	struct input_device_id *id;
 
 	if (!handler) return;
 
 	INIT_LIST_HEAD(&handler->h_list);
 
+	/* without an index, new devices are matched the slow way */
+	if (!input_index_handler(handler)) {
+		printk(KERN_WARNING "input: no memory to index handler %s\n", handler->name);
+		input_unindexed++;
+	}
+
 	if (handler->fops != NULL)
 		input_table[handler->minor >> 5] = handler;
 
 	list_add_tail(&handler->node, &input_handler_list);
 
 	list_for_each_entry(dev, &input_dev_list, node)
-		if (!handler->blacklist || !input_match_device(handler->blacklist, dev))
-			if ((id = input_match_device(handler->id_table, dev)))
-				if ((handle = handler->connect(handler, dev, id)))
-					input_link_handle(handle);
+		input_connect_handler(handler, dev);
 
 #ifdef CONFIG_PROC_FS
 	input_devices_state++;
@@ -507,12 +1510,15 @@ void input_unregister_handler(struct input_handler *handler)
 
 	list_for_each_safe(node, next, &handler->h_list) {
 		struct input_handle * handle = to_handle_h(node);
+		input_desc_invalidate(handle->dev);
+		input_batch_unbind(handle);
 		list_del_init(&handle->h_node);
 		list_del_init(&handle->d_node);
 		handler->disconnect(handle);
 	}
 
 	list_del_init(&handler->node);
+	input_unindex_handler(handler);
 
 	if (handler->fops != NULL)
 		input_table[handler->minor >> 5] = NULL;
@@ -587,58 +1593,124 @@ static unsigned int input_devices_poll(struct file *file, poll_table *wait)
 	return 0;
 }
 
-static int input_devices_read(char *buf, char **start, off_t pos, int count, int *eof, void *data)
+/*
+ * The text of a device is formatted once into a page and kept until a
+ * handler connects to or leaves the device.
+ */
+static int input_devices_format(struct input_dev *dev, char *buf)
 {
-	struct input_dev *dev;
 	struct input_handle *handle;
+	int i, len;
 
-	off_t at = 0;
-	int i, len, cnt = 0;
+	len = sprintf(buf, "I: Bus=%04x Vendor=%04x Product=%04x Version=%04x\n",
+		dev->id.bustype, dev->id.vendor, dev->id.product, dev->id.version);
 
-	list_for_each_entry(dev, &input_dev_list, node) {
+	len += sprintf(buf + len, "N: Name=\"%s\"\n", dev->name ? dev->name : "");
+	len += sprintf(buf + len, "P: Phys=%s\n", dev->phys ? dev->phys : "");
+	len += sprintf(buf + len, "H: Handlers=");
 
-		len = sprintf(buf, "I: Bus=%04x Vendor=%04x Product=%04x Version=%04x\n",
-			dev->id.bustype, dev->id.vendor, dev->id.product, dev->id.version);
+	list_for_each_entry(handle, &dev->h_list, d_node)
+		len += sprintf(buf + len, "%s ", handle->name);
 
-		len += sprintf(buf + len, "N: Name=\"%s\"\n", dev->name ? dev->name : "");
-		len += sprintf(buf + len, "P: Phys=%s\n", dev->phys ? dev->phys : "");
-		len += sprintf(buf + len, "H: Handlers=");
+	len += sprintf(buf + len, "\n");
 
-		list_for_each_entry(handle, &dev->h_list, d_node)
-			len += sprintf(buf + len, "%s ", handle->name);
+	SPRINTF_BIT_B(evbit, "EV=", EV_MAX);
+	SPRINTF_BIT_B2(keybit, "KEY=", KEY_MAX, EV_KEY);
+	SPRINTF_BIT_B2(relbit, "REL=", REL_MAX, EV_REL);
+	SPRINTF_BIT_B2(absbit, "ABS=", ABS_MAX, EV_ABS);
+	SPRINTF_BIT_B2(mscbit, "MSC=", MSC_MAX, EV_MSC);
+	SPRINTF_BIT_B2(ledbit, "LED=", LED_MAX, EV_LED);
+	SPRINTF_BIT_B2(sndbit, "SND=", SND_MAX, EV_SND);
+	SPRINTF_BIT_B2(ffbit,  "FF=",  FF_MAX, EV_FF);
 
-		len += sprintf(buf + len, "\n");
+	len += sprintf(buf + len, "\n");
 
-		SPRINTF_BIT_B(evbit, "EV=", EV_MAX);
-		SPRINTF_BIT_B2(keybit, "KEY=", KEY_MAX, EV_KEY);
-		SPRINTF_BIT_B2(relbit, "REL=", REL_MAX, EV_REL);
-		SPRINTF_BIT_B2(absbit, "ABS=", ABS_MAX, EV_ABS);
-		SPRINTF_BIT_B2(mscbit, "MSC=", MSC_MAX, EV_MSC);
-		SPRINTF_BIT_B2(ledbit, "LED=", LED_MAX, EV_LED);
-		SPRINTF_BIT_B2(sndbit, "SND=", SND_MAX, EV_SND);
-		SPRINTF_BIT_B2(ffbit,  "FF=",  FF_MAX, EV_FF);
+	return len;
+}
 
-		len += sprintf(buf + len, "\n");
+static void *input_devices_seq_start(struct seq_file *seq, loff_t *pos)
+{
+	struct input_dev *dev;
+	loff_t n = *pos;
 
-		at += len;
+	list_for_each_entry(dev, &input_dev_list, node)
+		if (!n--)
+			return dev;
+	return NULL;
+}
 
-		if (at >= pos) {
-			if (!*start) {
-				*start = buf + (pos - (at - len));
-				cnt = at - pos;
-			} else  cnt += len;
-			buf += len;
-			if (cnt >= count)
-				break;
+static void *input_devices_seq_next(struct seq_file *seq, void *v, loff_t *pos)
+{
+	struct input_dev *dev = v;
+
+	(*pos)++;
+	if (dev->node.next == &input_dev_list)
+		return NULL;
+	return list_entry(dev->node.next, struct input_dev, node);
+}
+
+static void input_devices_seq_stop(struct seq_file *seq, void *v)
+{
+}
+
+static int input_devices_seq_show(struct seq_file *seq, void *v)
+{
+	struct input_dev *dev = v;
+	struct input_dev_state *st = input_state(dev);
+	char *buf, *desc = NULL;
+	int len;
+
+	if (st) {
+		spin_lock(&input_desc_lock);
+		if (st->desc) {
+			seq_puts(seq, st->desc);
+			spin_unlock(&input_desc_lock);
+			return 0;
 		}
+		spin_unlock(&input_desc_lock);
 	}
 
-	if (&dev->node == &input_dev_list)
-		*eof = 1;
+	if (!(buf = (char *) __get_free_page(GFP_KERNEL)))
+		return -ENOMEM;
+	len = input_devices_format(dev, buf);
+	seq_puts(seq, buf);
+
+	/* another reader may have cached it meanwhile */
+	if (st && (desc = kmalloc(len + 1, GFP_KERNEL))) {
+		memcpy(desc, buf, len + 1);
+		spin_lock(&input_desc_lock);
+		if (!st->desc) {
+			st->desc = desc;
+			desc = NULL;
+		}
+		spin_unlock(&input_desc_lock);
+	}
+	kfree(desc);
+	free_page((unsigned long) buf);
+	return 0;
+}
 
-	return (count > cnt) ? cnt : count;
+static struct seq_operations input_devices_seq_ops = {
+	.start	= input_devices_seq_start,
+	.next	= input_devices_seq_next,
+	.stop	= input_devices_seq_stop,
+	.show	= input_devices_seq_show,
+};
+
+static int input_proc_devices_open(struct inode *inode, struct file *file)
+{
+	return seq_open(file, &input_devices_seq_ops);
 }
 
+static struct file_operations input_devices_fileops = {
+	.owner		= THIS_MODULE,
+	.open		= input_proc_devices_open,
+	.poll		= input_devices_poll,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= seq_release,
+};
+
 static int input_handlers_read(char *buf, char **start, off_t pos, int count, int *eof, void *data)
 {
 	struct input_handler *handler;
@@ -674,6 +1746,37 @@ static int input_handlers_read(char *buf, char **start, off_t pos, int count, in
 	return (count > cnt) ? cnt : count;
 }
 
+static int input_entropy_seq_show(struct seq_file *seq, void *v)
+{
+	struct input_dev *dev = v;
+	struct input_dev_state *st = input_state(dev);
+
+	if (st)
+		seq_printf(seq, "P: Phys=%s Fed=%lu Skipped=%lu\n",
+			   dev->phys ? dev->phys : "", st->entropy_fed, st->entropy_skipped);
+	return 0;
+}
+
+static struct seq_operations input_entropy_seq_ops = {
+	.start	= input_devices_seq_start,
+	.next	= input_devices_seq_next,
+	.stop	= input_devices_seq_stop,
+	.show	= input_entropy_seq_show,
+};
+
+static int input_proc_entropy_open(struct inode *inode, struct file *file)
+{
+	return seq_open(file, &input_entropy_seq_ops);
+}
+
+static struct file_operations input_entropy_fileops = {
+	.owner		= THIS_MODULE,
+	.open		= input_proc_entropy_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= seq_release,
+};
+
 static int __init input_proc_init(void)
 {
 	struct proc_dir_entry *entry;
@@ -682,13 +1785,13 @@ static int __init input_proc_init(void)
 	if (proc_bus_input_dir == NULL)
 		return -ENOMEM;
 	proc_bus_input_dir->owner = THIS_MODULE;
-	entry = create_proc_read_entry("devices", 0, proc_bus_input_dir, input_devices_read, NULL);
+	entry = create_proc_entry("devices", 0, proc_bus_input_dir);
 	if (entry == NULL) {
 		remove_proc_entry("input", proc_bus);
 		return -ENOMEM;
 	}
 	entry->owner = THIS_MODULE;
-	entry->proc_fops->poll = input_devices_poll;
+	entry->proc_fops = &input_devices_fileops;
 	entry = create_proc_read_entry("handlers", 0, proc_bus_input_dir, input_handlers_read, NULL);
 	if (entry == NULL) {
 		remove_proc_entry("devices", proc_bus_input_dir);
@@ -696,20 +1799,37 @@ static int __init input_proc_init(void)
 		return -ENOMEM;
 	}
 	entry->owner = THIS_MODULE;
+	entry = create_proc_entry("entropy", 0, proc_bus_input_dir);
+	if (entry == NULL) {
+		remove_proc_entry("handlers", proc_bus_input_dir);
+		remove_proc_entry("devices", proc_bus_input_dir);
+		remove_proc_entry("input", proc_bus);
+		return -ENOMEM;
+	}
+	entry->owner = THIS_MODULE;
+	entry->proc_fops = &input_entropy_fileops;
 	return 0;
 }
 
 struct input_handle *input_find_handle(char *phys_descr)
 {                               
-	struct input_dev *dev;
+	struct input_dev_state *st;
 	struct input_handle *handle;
+	struct hlist_node *n;
 
-	list_for_each_entry(dev, &input_dev_list, node) {
-		list_for_each_entry(handle, &dev->h_list, d_node) {
-			if(!strcmp(handle->name,"kbd") && !strcmp(phys_descr,dev->phys) )
+	rcu_read_lock();
+	hlist_for_each_rcu(n, input_phys_head(phys_descr)) {
+		st = hlist_entry(n, struct input_dev_state, phys_node);
+		if (strcmp(phys_descr, st->dev->phys))
+			continue;
+		list_for_each_entry(handle, &st->dev->h_list, d_node) {
+			if(!strcmp(handle->name,"kbd")) {
+				rcu_read_unlock();
 				return handle;
+			}
 		}
 	}               
+	rcu_read_unlock();
 	printk(KERN_WARNING "input: no matching device for \"%s\"\n", phys_descr);
 	return NULL;            
 }               
@@ -733,6 +1853,7 @@ static int __init input_init(void)
 		printk(KERN_ERR "input: unable to register char major %d", INPUT_MAJOR);
 		remove_proc_entry("devices", proc_bus_input_dir);
 		remove_proc_entry("handlers", proc_bus_input_dir);
+		remove_proc_entry("entropy", proc_bus_input_dir);
 		remove_proc_entry("input", proc_bus);
 		class_simple_destroy(input_class);
 		return retval;
@@ -742,6 +1863,7 @@ static int __init input_init(void)
 	if (retval) {
 		remove_proc_entry("devices", proc_bus_input_dir);
 		remove_proc_entry("handlers", proc_bus_input_dir);
+		remove_proc_entry("entropy", proc_bus_input_dir);
 		remove_proc_entry("input", proc_bus);
 		unregister_chrdev(INPUT_MAJOR, "input");
 		class_simple_destroy(input_class);
@@ -751,8 +1873,17 @@ static int __init input_init(void)
 
 static void __exit input_exit(void)
 {
+#ifdef CONFIG_HOTPLUG
+	cancel_delayed_work(&input_hotplug_work);
+	flush_scheduled_work();
+	/* the remove events of the last devices may still be queued */
+	while (!list_empty(&input_hotplug_queue))
+		input_hotplug_flush(NULL);
+	flush_scheduled_work();
+#endif
 	remove_proc_entry("devices", proc_bus_input_dir);
 	remove_proc_entry("handlers", proc_bus_input_dir);
+	remove_proc_entry("entropy", proc_bus_input_dir);
 	remove_proc_entry("input", proc_bus);
 
 	devfs_remove("input");
@@ -914,7 +914,7 @@ static int vgacon_adjust_height(struct vc_data *vc, unsigned fontheight)
 static int vgacon_font_set(struct vc_data *c, struct console_font *font, unsigned flags)
 {
 	unsigned charcount = font->charcount;
-	int rc;
+	int rc = 0;
 
 	if (vga_video_type < VIDEO_TYPE_EGAM)
 		return -EINVAL;
@@ -922,9 +922,11 @@ static int vgacon_font_set(struct vc_data *c, struct console_font *font, unsigne
 	if (font->width != 8 || (charcount != 256 && charcount != 512))
 		return -EINVAL;
 
-	rc = vgacon_do_font_op(&state, font->data, 1, charcount == 512);
-	if (rc)
-		return rc;
+	if (!(flags & KD_FONT_FLAG_LOADED)) {
+		rc = vgacon_do_font_op(&state, font->data, 1, charcount == 512);
+		if (rc)
+			return rc;
+	}
 
 	if (!(flags & KD_FONT_FLAG_DONT_RECALC))
 		rc = vgacon_adjust_height(c, font->height);
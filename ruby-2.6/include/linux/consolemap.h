@@ -11,5 +11,6 @@
 struct vc_data;
 
 extern unsigned char inverse_translate(struct vc_data *vc, int glyph);
+extern const unsigned char *inverse_translate_map(struct vc_data *vc);
 extern void set_translate(struct vc_data *vc, int m);
 extern int conv_uni_to_pc(struct vc_data *vc, long ucs);
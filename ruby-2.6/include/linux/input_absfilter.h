@@ -0,0 +1,37 @@
+/*
+ * input_absfilter.h
+ *
+ * Per axis filter chain the input core runs on EV_ABS events before
+ * they reach any handler: a deadzone around the centre of the axis,
+ * hysteresis, exponential smoothing and a limit on the change per
+ * event, in that order.  All of it is off (zero) by default.  Set and
+ * read with EVIOCSABSFILTER/EVIOCGABSFILTER on the event device, next
+ * to EVIOCSABS/EVIOCGABS.
+ */
+
+#ifndef _LINUX_INPUT_ABSFILTER_H
+#define _LINUX_INPUT_ABSFILTER_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+struct input_absfilter {
+	__u16	axis;		/* ABS_* */
+	__u16	smoothing;	/* weight of a new value in 1/256, 0 for none */
+	__s32	deadzone;	/* values this close to the centre read as the centre */
+	__s32	hysteresis;	/* smaller changes are dropped */
+	__s32	rate;		/* largest change per event, 0 for no limit */
+};
+
+#define EVIOCGABSFILTER	_IOWR('E', 0xb0, struct input_absfilter)
+#define EVIOCSABSFILTER	_IOW('E', 0xb1, struct input_absfilter)
+
+#ifdef __KERNEL__
+
+struct input_dev;
+
+int input_absfilter_ioctl(struct input_dev *dev, unsigned int cmd, void __user *p);
+
+#endif
+
+#endif
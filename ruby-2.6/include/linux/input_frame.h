@@ -0,0 +1,75 @@
+/*
+ * input_frame.h
+ *
+ * Frame at a time delivery in the input core.  A device driver hands a
+ * whole report, ending with SYN_REPORT, to input_events().  Handlers
+ * that registered an input_batch see the accepted events of the frame
+ * in one call, the others still get them one by one through event().
+ */
+
+#ifndef _LINUX_INPUT_FRAME_H
+#define _LINUX_INPUT_FRAME_H
+
+#include <linux/input.h>
+
+/* Autorepeat the core sets up for devices that leave it to the core */
+#define INPUT_REP_DELAY_DEFAULT		250	/* ms */
+#define INPUT_REP_PERIOD_DEFAULT	33	/* ms */
+
+struct input_value {
+	__u16 type;
+	__u16 code;
+	__s32 value;
+};
+
+struct input_batch {
+	struct input_handler *handler;
+	void (*events)(struct input_handle *handle, struct input_value *vals,
+		       unsigned int count);
+	struct list_head node;
+};
+
+/*
+ * Event ring.  While a device has readers attached, every accepted event
+ * is stored once in its ring, stamped with sched_clock() or the source
+ * timestamp the driver gave with input_set_timestamp(), and each
+ * reader walks it with its own cursor instead of keeping a copy.  A
+ * reader that falls more than INPUT_RING_SIZE events behind loses the
+ * oldest ones and finds overrun set.
+ */
+#define INPUT_RING_SIZE		256	/* power of two */
+
+struct input_ring_event {
+	unsigned long long stamp;
+	__u16 type;
+	__u16 code;
+	__s32 value;
+};
+
+struct input_ring {
+	struct input_dev *dev;
+	int users;
+	unsigned int head;		/* events written */
+	unsigned int next;		/* head once the current write is done */
+	unsigned int frame;		/* head before the last write */
+	struct input_ring_event events[INPUT_RING_SIZE];
+};
+
+struct input_cursor {
+	struct input_ring *ring;
+	unsigned int tail;
+	int overrun;
+};
+
+void input_events(struct input_dev *dev, struct input_value *vals, unsigned int count);
+void input_set_timestamp(struct input_dev *dev, unsigned long long stamp);
+unsigned long long input_get_timestamp(struct input_dev *dev);
+void input_register_batch(struct input_batch *batch);
+void input_unregister_batch(struct input_batch *batch);
+
+int input_cursor_attach(struct input_cursor *cursor, struct input_dev *dev);
+void input_cursor_detach(struct input_cursor *cursor);
+int input_cursor_read(struct input_cursor *cursor, struct input_ring_event *ev);
+void input_cursor_frame(struct input_cursor *cursor);
+
+#endif
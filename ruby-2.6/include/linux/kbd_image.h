@@ -0,0 +1,57 @@
+/*
+ * kbd_image.h
+ *
+ * Packed keymap image, loaded and dumped with KDSKBIMAGE/KDGKBIMAGE
+ * in one ioctl instead of one KDSKBENT per table and key.  Layout:
+ *
+ *	struct kbimage_header
+ *	nr_maps times struct kbimage_map followed by `keys' values
+ *	nr_diacrs times struct kbdiacr
+ *	nr_funcs times a byte holding the function key index followed
+ *	by its NUL terminated string
+ *
+ * Key values are those used by KDSKBENT.
+ */
+
+#ifndef _LINUX_KBD_IMAGE_H
+#define _LINUX_KBD_IMAGE_H
+
+#include <linux/types.h>
+
+#define KDGKBIMAGE	0x4B80	/* dump keymap image */
+#define KDSKBIMAGE	0x4B81	/* load keymap image */
+#define KDSKBSENTS	0x4B82	/* set several function key strings */
+
+#define KBIMAGE_MAGIC		0x4b424d50	/* "KBMP" */
+#define KBIMAGE_VERSION		1
+#define KBIMAGE_MAX_SIZE	(512 * 1024)
+
+struct kbimage_header {
+	__u32	magic;
+	__u16	version;
+	__u16	keys;		/* values per map, must be NR_KEYS */
+	__u32	size;		/* of the whole image; buffer size for KDGKBIMAGE */
+	__u16	nr_maps;
+	__u16	nr_diacrs;
+	__u16	nr_funcs;
+	__u16	reserved;
+};
+
+struct kbimage_map {
+	__u16	table;		/* shift state, below MAX_NR_KEYMAPS */
+	__u16	reserved;
+	__u16	map[0];
+};
+
+/*
+ * KDSKBSENTS argument: count function key strings packed as in the
+ * image.  Function keys not mentioned keep their strings.
+ */
+struct kbsentries {
+	__u32	size;		/* of the whole argument */
+	__u16	count;
+	__u16	reserved;
+	unsigned char data[0];
+};
+
+#endif
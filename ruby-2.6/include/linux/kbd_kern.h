@@ -12,9 +12,6 @@ extern struct tasklet_struct keyboard_tasklet;
 extern int shift_state;
 
 extern char *func_table[MAX_NR_FUNC];
-extern char func_buf[];
-extern char *funcbufptr;
-extern int  funcbufsize, funcbufleft;
 
 #define KBD_DEFMODE	((1 << VC_REPEAT) | (1 << VC_META))
 
@@ -157,9 +154,16 @@ int setkeycode(struct input_handle *handle, unsigned int scancode, unsigned int
 void kd_mksound(struct input_handle *handle, unsigned int hz, unsigned int ticks);
 void kd_nosound(unsigned long private);
 int kbd_rate(struct input_handle *handle, struct kbd_repeat *rep);
+void kbd_vc_rate(struct vc_data *vc);
 void puts_queue(struct vc_data *vc, char *cp);
 void compute_shiftstate(void);
 
+struct kbd_diacr_index;
+struct kbd_diacr_index *kbd_diacr_build(const struct kbdiacr *table, unsigned int n);
+struct kbd_diacr_index *kbd_diacr_install(struct kbd_diacr_index *index);
+void kbd_diacr_free(struct kbd_diacr_index *index);
+unsigned int kbd_diacr_dump(struct kbdiacr *table, unsigned int max);
+
 /* defkeymap.c */
 
 extern unsigned int keymap_count;
@@ -15,12 +15,15 @@ extern struct vc_data *sel_cons;
 extern void clear_selection(void);
 extern int set_selection(const struct tiocl_selection __user *sel, struct tty_struct *tty);
 extern int paste_selection(struct tty_struct *tty);
+extern void paste_cancel(struct vc_data *vc);
+extern void paste_unthrottle(struct vc_data *vc);
 extern int sel_loadlut(char __user *p);
 extern int mouse_reporting(struct vc_data *vc);
 extern void mouse_report(struct vc_data *vc, int butt, int mrx, int mry);
 
 extern unsigned short *screen_pos(struct vc_data *vc, int w_offset, int viewed);
 extern u16 screen_glyph(struct vc_data *vc, int offset);
+extern u32 screen_uni(struct vc_data *vc, int offset, int viewed);
 extern void complement_pos(struct vc_data *vc, int offset);
 extern void invert_screen(struct vc_data *vc, int offset, int count, int shift);
 
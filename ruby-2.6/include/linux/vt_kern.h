@@ -87,6 +87,7 @@ struct vc_data {
 	unsigned int vc_top, vc_bottom;	/* Scrolling region */
 	unsigned short *vc_screenbuf;	/* In-memory character/attribute buffer */
 	unsigned int vc_screenbuf_size;
+	u32 *vc_uni_screen;		/* Unicode shadow of the screen or NULL */
 	unsigned char vc_attr;		/* Current attributes */
 	unsigned char vc_def_color;	/* Default colors */
 	unsigned char vc_color;		/* Foreground & background */
@@ -105,6 +106,10 @@ struct vc_data {
 	unsigned int vc_state;		/* Escape sequence parser state */
 	unsigned int vc_npar, vc_par[NPAR];	/* Parameters of current escape sequence */
 	struct kbd_struct kbd_table;	/* VC keyboard state */
+	unsigned long kbd_overruns;	/* Keyboard input lost, flip buffer full */
+	unsigned long long kbd_flip_stamp; /* Keyboard flip pushed, for latency */
+	unsigned int kbd_rep_delay;	/* KDKBDREP of this VC, 0 if none */
+	unsigned int kbd_rep_period;
 	unsigned short vc_hi_font_mask;	/* [#] Attribute set for upper 256 chars of font or 0 if not supported */
 	struct console_font vc_font;	/* VC current font set */
 	struct vt_struct *display_fg;	/* Ptr to display */
@@ -158,10 +163,20 @@ struct vc_data {
 	unsigned char vc_saved_G1;
 	unsigned int vc_bell_pitch;	/* Console bell pitch */
 	unsigned int vc_bell_duration;	/* Console bell duration */
+	unsigned long vc_bell_end;	/* Current bell sounds until then */
+	unsigned long vc_bell_window;	/* Start of the bell rate window */
+	unsigned int vc_bell_count;	/* Bells rung in that window */
 	unsigned long vc_uni_pagedir;
 	unsigned long *vc_uni_pagedir_loc;/* [!] Location of uni_pagedir 
 						 variable for this console */
-	wait_queue_head_t paste_wait;	/* For selections */
+	/* selection pasting, see paste_selection() */
+	struct list_head paste_node;	/* On the list of pending pastes */
+	char *paste_buf;		/* Private copy of the selection */
+	unsigned int paste_len;
+	unsigned int paste_pos;		/* Bytes of paste_buf delivered */
+	unsigned long paste_bytes;	/* Bytes pasted in total */
+	unsigned int paste_count;	/* Pastes started */
+	unsigned int paste_cancelled;	/* Pastes cut short */
 	/* Internal flags */
 	unsigned int vc_decscl;		/* operating level */
 	unsigned int vc_c8bit:1;	/* 8-bit controls */
@@ -188,6 +203,26 @@ struct vc_data {
 	unsigned char vc_saved_GS;
 };
 
+/*
+ * Keyboard latency histograms, kept per VT while enabled through
+ * /proc/bus/console/<vt>/latency.  Bucket n counts delays below 2^n
+ * microseconds (of 1024ns), the last one everything longer.
+ */
+#define KBD_LAT_INPUT	0	/* key (source timestamp if any) to kbd_keycode() */
+#define KBD_LAT_QUEUE	1	/* kbd_keycode() to flip push */
+#define KBD_LAT_LDISC	2	/* flip push to ldisc receive_buf() */
+#define KBD_LAT_STAGES	3
+#define KBD_LAT_BUCKETS	16
+
+struct kbd_latency {
+	unsigned long hist[KBD_LAT_STAGES][KBD_LAT_BUCKETS];
+};
+
+/* con_font_set() flag: the display already has this font loaded */
+#define KD_FONT_FLAG_LOADED	0x20000000
+
+struct con_font;
+
 struct consw {
 	struct module *owner;
 	const char *(*con_startup)(struct vt_struct *, int);
@@ -226,6 +261,15 @@ struct vt_struct {
 	char kmalloced;		/* Did we use kmalloced ? */
 	char vt_dont_switch;	/* VC switching flag */
 	char vt_blanked;	/* Is this display blanked */
+	char vt_uni_screen;	/* Keep Unicode shadow screens for the VCs */
+	char vt_latency_on;	/* Collect keyboard latency histograms */
+	char vt_bell_mode;	/* VT_BELL_* */
+#define VT_BELL_AUDIBLE	0
+#define VT_BELL_VISUAL	1
+#define VT_BELL_BOTH	2
+	char vt_bell_flash;	/* Visual bell: 1 pending, 2 shown */
+	struct vc_data *vt_bell_vc;	/* VC showing the visual bell */
+	struct work_struct vt_bell_work;
 	int blank_mode;		/* 0:none 1:suspendV 2:suspendH 3:powerdown */
 	int blank_interval;	/* How long before blanking */
 	int off_interval;
@@ -256,6 +300,8 @@ struct vt_struct {
 	unsigned char vt_ledstate;
 	unsigned char vt_ledioctl;
 	char *display_desc;
+	struct con_font *vt_font;	/* Font last loaded on the display */
+	struct kbd_latency *vt_latency;	/* Allocated when first enabled */
 	struct	class_device	dev;		/* Generic device interface */
 };
 
@@ -289,6 +335,10 @@ inline void set_console(struct vc_data *vc);
 int vc_resize(struct vc_data *vc, unsigned int lines, unsigned int cols);
 int vc_disallocate(struct vc_data *vc);
 void reset_vc(struct vc_data *vc);
+int vc_uniscr_alloc(struct vc_data *vc);
+void vc_uniscr_free(struct vc_data *vc);
+void vc_uniscr_fill(struct vc_data *vc, unsigned int offset, u32 ch, int count);
+void vc_bell(struct vc_data *vc);
 void add_softcursor(struct vc_data *vc);
 void set_cursor(struct vc_data *vc);
 void hide_cursor(struct vc_data *vc);
@@ -323,11 +373,15 @@ int con_font_set(struct vc_data *vc, struct console_font_op *op);
 int con_font_get(struct vc_data *vc, struct console_font_op *op);
 int con_font_default(struct vc_data *vc, struct console_font_op *op);
 int con_font_copy(struct vc_data *vc, struct console_font_op *op);
+void con_font_forget(struct vt_struct *vt);
 int take_over_console(struct vt_struct *vt, const struct consw *sw);
 
 int tioclinux(struct tty_struct *tty, unsigned long arg);
 extern struct tty_driver *console_device(int *);
 
+/* keyboard.c */
+void kbd_flip_received(struct tty_struct *tty);
+
 /* consolemap.c */
 struct unimapinit;
 struct unipair;